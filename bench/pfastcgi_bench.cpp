@@ -0,0 +1,403 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018 hepangda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+// Micro and macro benchmarks for pfastcgi.hpp. Build and run with
+//
+//   g++ -O2 -std=c++11 -I. bench/pfastcgi_bench.cpp -o pfastcgi_bench -pthread
+//   ./pfastcgi_bench [iterations]
+//
+// or as the pfastcgi_bench target of the CMake build.
+//
+// The end-to-end runs talk to an in-process mock responder over a Unix
+// socket and over TCP on 127.0.0.1.
+
+#include "pfastcgi.hpp"
+
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace pfcgi;
+using Clock = std::chrono::steady_clock;
+
+// A typical set of CGI variables as a PHP-FPM gateway sends them.
+const char *const kParams[][2] = {
+    {"GATEWAY_INTERFACE", "CGI/1.1"},
+    {"SERVER_SOFTWARE", "pfastcgi"},
+    {"SERVER_NAME", "www.example.com"},
+    {"SERVER_ADDR", "10.0.0.1"},
+    {"SERVER_PORT", "443"},
+    {"SERVER_PROTOCOL", "HTTP/1.1"},
+    {"REQUEST_METHOD", "GET"},
+    {"REQUEST_SCHEME", "https"},
+    {"REQUEST_URI", "/index.php?page=1&sort=desc&filter=recent"},
+    {"DOCUMENT_URI", "/index.php"},
+    {"DOCUMENT_ROOT", "/srv/www/example"},
+    {"SCRIPT_NAME", "/index.php"},
+    {"SCRIPT_FILENAME", "/srv/www/example/index.php"},
+    {"QUERY_STRING", "page=1&sort=desc&filter=recent"},
+    {"CONTENT_TYPE", ""},
+    {"CONTENT_LENGTH", "0"},
+    {"REMOTE_ADDR", "192.168.10.20"},
+    {"REMOTE_PORT", "53122"},
+    {"HTTPS", "on"},
+    {"REDIRECT_STATUS", "200"},
+    {"HTTP_HOST", "www.example.com"},
+    {"HTTP_USER_AGENT",
+     "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like "
+     "Gecko) Chrome/120.0 Safari/537.36"},
+    {"HTTP_ACCEPT",
+     "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"},
+    {"HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5"},
+    {"HTTP_ACCEPT_ENCODING", "gzip, deflate, br"},
+    {"HTTP_CONNECTION", "keep-alive"},
+    {"HTTP_COOKIE", "session=0123456789abcdef0123456789abcdef; theme=dark"},
+    {"HTTP_CACHE_CONTROL", "max-age=0"},
+    {"HTTP_UPGRADE_INSECURE_REQUESTS", "1"},
+    {"HTTP_X_FORWARDED_FOR", "203.0.113.7"},
+    {"HTTP_X_REQUEST_ID", "5f0c6f2e-3a43-4c1b-9a7e-8d9f1f2b3c4d"},
+    {"HTTP_REFERER", "https://www.example.com/"},
+};
+const size_t kParamCount = sizeof(kParams) / sizeof(kParams[0]);
+
+// Results are folded into this so the optimizer keeps the measured work.
+volatile size_t g_sink;
+
+double seconds(Clock::time_point since) {
+  return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+// The per-pair encoding sendParams used before the builder: a heap buffer
+// per pair and 4-byte lengths throughout.
+size_t legacyEncode(const char *key, const char *value, int request_id) {
+  auto key_length = strlen(key), value_length = strlen(value),
+       all_length = 16 + key_length + value_length;
+
+  std::unique_ptr<Byte[]> buf(new Byte[all_length]);
+  new (buf.get()) FcgiHeader(kTypeParams, 8 + key_length + value_length,
+                             request_id);
+  Byte *prefix = buf.get() + sizeof(FcgiHeader);
+  for (auto length : {key_length, value_length}) {
+    prefix[0] = (length >> 24) | 0x80;
+    prefix[1] = length >> 16;
+    prefix[2] = length >> 8;
+    prefix[3] = length;
+    prefix += 4;
+  }
+  memcpy(buf.get() + 16, key, key_length);
+  memcpy(buf.get() + 16 + key_length, value, value_length);
+
+  g_sink = g_sink + buf[all_length - 1];
+  return all_length;
+}
+
+void benchEncode(int iterations) {
+  size_t bytes = 0;
+
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i)
+    for (size_t j = 0; j < kParamCount; ++j)
+      bytes += legacyEncode(kParams[j][0], kParams[j][1], 1);
+  double legacy = seconds(start);
+  size_t legacy_bytes = bytes / iterations;
+
+  FcgiRequestArena arena;
+  bytes = 0;
+  start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    FcgiParamsBuilder builder(1, &arena);
+    for (size_t j = 0; j < kParamCount; ++j)
+      builder.add(kParams[j][0], kParams[j][1]);
+    builder.finish();
+    bytes += builder.size();
+    g_sink = g_sink + builder.data()[builder.size() - 1];
+    arena.reset();
+  }
+  double built = seconds(start);
+  size_t built_bytes = bytes / iterations;
+
+  printf("encode %zu params/request\n", kParamCount);
+  printf("  legacy per-pair   %8.0f req/s  %5zu bytes/req\n",
+         iterations / legacy, legacy_bytes);
+  printf("  FcgiParamsBuilder %8.0f req/s  %5zu bytes/req\n",
+         iterations / built, built_bytes);
+}
+
+// Sends params over a socketpair drained by another thread, to include
+// the syscall cost of one send per pair against one send per request.
+void benchSendParams(int iterations) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return;
+
+  std::thread drain([&] {
+    Byte buf[64 * 1024];
+    while (::recv(sv[1], buf, sizeof(buf), 0) > 0) {
+    }
+  });
+
+  struct Manager : FcgiManager {
+    explicit Manager(int fd) { set_fcgifd(fd); }
+    int start(const char *, int) override { return 0; }
+  } manager(sv[0]);
+
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (size_t j = 0; j < kParamCount; ++j)
+      manager.sendParams(kParams[j][0], kParams[j][1], 1);
+    manager.endParams(1);
+  }
+  double per_pair = seconds(start);
+
+  start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    FcgiParamsBuilder builder(1);
+    for (size_t j = 0; j < kParamCount; ++j)
+      builder.add(kParams[j][0], kParams[j][1]);
+    manager.sendParams(builder);
+  }
+  double batched = seconds(start);
+
+  shutdown(sv[0], SHUT_WR);
+  drain.join();
+  close(sv[1]);
+
+  printf("send params over a socketpair\n");
+  printf("  sendParams per pair %8.0f req/s  %zu sends/req\n",
+         iterations / per_pair, kParamCount + 1);
+  printf("  sendParams(builder) %8.0f req/s  1 send/req\n",
+         iterations / batched);
+}
+
+std::string responseStream(int records, size_t record_length) {
+  std::string stream;
+  std::string content(record_length, 'x');
+  for (int i = 0; i < records; ++i) {
+    auto padding = FcgiManager::paddingFor(content.size());
+    FcgiHeader header(i % 8 == 7 ? kTypeStderr : kTypeStdout, content.size(),
+                      1, padding);
+    stream.append(reinterpret_cast<char *>(&header), sizeof(header));
+    stream += content;
+    stream.append(padding, '\0');
+  }
+  return stream;
+}
+
+void benchParse(int iterations) {
+  auto stream = responseStream(256, 200);
+  auto data = reinterpret_cast<const Byte *>(stream.data());
+
+  struct Manager : FcgiManager {
+    int start(const char *, int) override { return 0; }
+  } manager;
+
+  size_t records = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    FcgiResponseReader reader(manager);
+    reader.feed(data, stream.size());
+    FcgiRecord record;
+    while (reader.parse(&record) == 1) {
+      ++records;
+      g_sink = g_sink + record.content_length;
+    }
+  }
+  double parsed = seconds(start);
+
+  std::vector<FcgiRecordDesc> index(256);
+  size_t scanned_records = 0, consumed;
+  start = Clock::now();
+  for (int i = 0; i < iterations; ++i)
+    scanned_records += fcgiScanRecords(data, stream.size(), index.data(),
+                                       index.size(), &consumed);
+  double scanned = seconds(start);
+
+  double mb = stream.size() * static_cast<double>(iterations) / (1 << 20);
+  printf("parse %d-byte records\n", 200);
+  printf("  FcgiResponseReader %8.0f MiB/s  %10.0f records/s\n",
+         mb / parsed, records / parsed);
+  printf("  fcgiScanRecords    %8.0f MiB/s  %10.0f records/s\n",
+         mb / scanned, scanned_records / scanned);
+}
+
+// Answers every request with a short STDOUT body and END_REQUEST, keeping
+// the connection open when the request asked for it.
+void mockConnection(int fd) {
+  struct Manager : FcgiManager {
+    explicit Manager(int fd) { set_fcgifd(fd); }
+    int start(const char *, int) override { return 0; }
+  } manager(fd);
+
+  static const char kBody[] =
+      "Status: 200 OK\r\nContent-Type: text/html\r\n\r\n"
+      "<html><body>hello from the mock responder</body></html>";
+  FcgiResponseReader reader(manager);
+  FcgiRecord record;
+  bool keep_alive = false;
+
+  while (reader.next(&record) == 1) {
+    if (record.type == kTypeBegin) {
+      keep_alive = record.content[2] & kFcgiKeepAlive;
+    } else if (record.type == kTypeStdin && record.content_length == 0) {
+      int id = record.request_id;
+      size_t body_length = sizeof(kBody) - 1,
+             padding = FcgiManager::paddingFor(body_length);
+      FcgiHeader stdout_header(kTypeStdout, body_length, id, padding),
+          stdout_end(kTypeStdout, 0, id),
+          end_header(kTypeEnd, sizeof(FcgiRequestEndBody), id);
+      FcgiRequestEndBody end_body(0, kRequestComplete);
+
+      iovec iov[] = {{&stdout_header, sizeof(stdout_header)},
+                     {const_cast<char *>(kBody), body_length},
+                     {const_cast<Byte *>(kFcgiPadding), padding},
+                     {&stdout_end, sizeof(stdout_end)},
+                     {&end_header, sizeof(end_header)},
+                     {&end_body, sizeof(end_body)}};
+      if (manager.doWritev(iov, 6) < 0 || !keep_alive) break;
+    }
+  }
+}
+
+void mockServe(int listener) {
+  for (;;) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) return;
+    std::thread(mockConnection, fd).detach();
+  }
+}
+
+void printLatency(const char *name, std::vector<double> &samples,
+                  double elapsed) {
+  std::sort(samples.begin(), samples.end());
+  auto at = [&samples](double q) {
+    return samples[static_cast<size_t>(q * (samples.size() - 1))] * 1e6;
+  };
+  printf("  %-5s %8.0f req/s  p50 %6.1fus  p90 %6.1fus  p99 %6.1fus  "
+         "p99.9 %6.1fus\n",
+         name, samples.size() / elapsed, at(0.5), at(0.9), at(0.99),
+         at(0.999));
+}
+
+void benchEndToEnd(const char *name, const FcgiEndpoint &endpoint,
+                   int iterations) {
+  FcgiConnectionPool pool(endpoint);
+  std::vector<double> samples;
+  samples.reserve(iterations);
+
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    auto begin = Clock::now();
+    auto manager = pool.acquire();
+    if (manager == nullptr) {
+      printf("  %-5s connect failed\n", name);
+      return;
+    }
+    // BEGIN, PARAMS and STDIN go out as separate writes, which Nagle would
+    // otherwise hold back behind the responder's delayed ACK.
+    if (!endpoint.local()) {
+      int one = 1;
+      setsockopt(manager->fd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    FcgiParamsBuilder builder(1);
+    for (size_t j = 0; j < kParamCount; ++j)
+      builder.add(kParams[j][0], kParams[j][1]);
+
+    bool ended = false;
+    if (manager->startParams(kRoleResponder, true, 1) >= 0 &&
+        manager->sendParams(builder) >= 0 && manager->endStdin(1) >= 0) {
+      FcgiResponseReader reader(*manager, kFcgiMaxRecordLength);
+      FcgiRecord record;
+      while (!ended && reader.next(1, &record) == 1)
+        ended = record.type == kTypeEnd;
+    }
+    pool.release(std::move(manager), ended);
+    samples.push_back(seconds(begin));
+  }
+  printLatency(name, samples, seconds(start));
+}
+
+void benchEndToEnd(int iterations) {
+  const char *path = "/tmp/pfastcgi_bench.sock";
+  unlink(path);
+
+  int unix_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un unix_addr;
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  strcpy(unix_addr.sun_path, path);
+
+  int inet_listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in inet_addr;
+  socklen_t inet_length = sizeof(inet_addr);
+  memset(&inet_addr, 0, sizeof(inet_addr));
+  inet_addr.sin_family = AF_INET;
+  inet_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(unix_listener, (sockaddr *)&unix_addr, sizeof(unix_addr)) < 0 ||
+      listen(unix_listener, 128) < 0 ||
+      bind(inet_listener, (sockaddr *)&inet_addr, sizeof(inet_addr)) < 0 ||
+      listen(inet_listener, 128) < 0 ||
+      getsockname(inet_listener, (sockaddr *)&inet_addr, &inet_length) < 0) {
+    perror("mock responder");
+    return;
+  }
+
+  std::thread unix_server(mockServe, unix_listener),
+      inet_server(mockServe, inet_listener);
+
+  printf("end-to-end against the mock responder, keep-alive pool\n");
+  benchEndToEnd("unix", FcgiEndpoint(path), iterations);
+  benchEndToEnd("inet", FcgiEndpoint("127.0.0.1", ntohs(inet_addr.sin_port)),
+                iterations);
+
+  shutdown(unix_listener, SHUT_RDWR);
+  shutdown(inet_listener, SHUT_RDWR);
+  unix_server.join();
+  inet_server.join();
+  close(unix_listener);
+  close(inet_listener);
+  unlink(path);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  if (iterations <= 0) iterations = 100000;
+
+  benchEncode(iterations);
+  benchSendParams(iterations / 10 + 1);
+  benchParse(iterations / 10 + 1);
+  benchEndToEnd(iterations / 10 + 1);
+  return 0;
+}
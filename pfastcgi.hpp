@@ -26,15 +26,65 @@
 #define PFASTCGI_PFASTCGI_H
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cerrno>
+#include <climits>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && \
+    __has_include(<coroutine>)
+#define PFASTCGI_HAS_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#include <utility>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef PFASTCGI_INSTRUMENTATION
+#include <time.h>
+#endif
+
+#ifdef PFASTCGI_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 namespace pfcgi {
 
@@ -42,6 +92,14 @@ using Byte = unsigned char;
 
 const int kFcgiVersion = 1;
 const int kFcgiKeepAlive = 1;
+const int kFcgiMaxContentLength = 0xffff;
+const size_t kFcgiMaxRecordLength = 8 + kFcgiMaxContentLength + 0xff;
+const int kFcgiMaxRequestId = 0xffff;
+const Byte kFcgiPadding[8] = {};
+
+const char kFcgiMaxConns[] = "FCGI_MAX_CONNS";
+const char kFcgiMaxReqs[] = "FCGI_MAX_REQS";
+const char kFcgiMpxsConns[] = "FCGI_MPXS_CONNS";
 
 enum FcgiType {
   kTypeBegin = 1,
@@ -59,6 +117,13 @@ enum FcgiType {
 
 enum FcgiRole { kRoleResponder = 1, kRoleAuthorizer = 2, kRoleFilter = 3 };
 
+enum FcgiProtocolStatus {
+  kRequestComplete = 0,
+  kCantMpxConn = 1,
+  kOverloaded = 2,
+  kUnknownRole = 3
+};
+
 struct FcgiHeader {
   Byte version;
   Byte type;
@@ -129,169 +194,5776 @@ struct FcgiRequestBegin {
   FcgiRequestBeginBody body;
 };
 
-// struct FcgiRequestEndBody {
-//   unsigned char appStatusB3;
-//   unsigned char appStatusB2;
-//   unsigned char appStatusB1;
-//   unsigned char appStatusB0;
-//   unsigned char protocolStatus;
-//   unsigned char reserved[3];
-// };
-
-struct FcgiParams {
-  Byte name_length3;
-  Byte name_length2;
-  Byte name_length1;
-  Byte name_length0;
-  Byte value_length3;
-  Byte value_length2;
-  Byte value_length1;
-  Byte value_length0;
-
-  FcgiParams() {}
-
-  FcgiParams(int name_length, int value_length)
-      : name_length3((name_length >> 24) | 0x80),
-        name_length2(name_length >> 16),
-        name_length1(name_length >> 8),
-        name_length0(name_length),
-        value_length3((value_length >> 24) | 0x80),
-        value_length2(value_length >> 16),
-        value_length1(value_length >> 8),
-        value_length0(value_length) {}
-
-  // TODO: finish name_length()
-  // int name_length() const { return (name_length3 << 24) & 0x0F; }
-
-  void set_name_length(int name_length) {
-    name_length3 = (name_length >> 24) | 0x80;
-    name_length2 = name_length >> 16;
-    name_length1 = name_length >> 8;
-    name_length0 = name_length;
+struct FcgiRequestEndBody {
+  Byte app_status3;
+  Byte app_status2;
+  Byte app_status1;
+  Byte app_status0;
+  Byte protocol_status;
+  Byte reserved[3];
+
+  FcgiRequestEndBody() {}
+
+  FcgiRequestEndBody(int app_status, FcgiProtocolStatus protocol_status)
+      : app_status3((app_status >> 24) & 0xff),
+        app_status2((app_status >> 16) & 0xff),
+        app_status1((app_status >> 8) & 0xff),
+        app_status0(app_status & 0xff),
+        protocol_status(protocol_status),
+        reserved() {}
+
+  int app_status() const {
+    return (app_status3 << 24) + (app_status2 << 16) + (app_status1 << 8) +
+           app_status0;
   }
 };
 
-class FcgiManager {
+struct FcgiRequestEnd {
+  FcgiHeader header;
+  FcgiRequestEndBody body;
+};
+
+// Answer to a management record of a type the application does not know.
+struct FcgiUnknownTypeBody {
+  Byte type;
+  Byte reserved[7];
+};
+
+// Length prefix of one name-value pair. Each length takes one byte when it
+// is below 128 and four bytes with the high bit set otherwise.
+class FcgiParams {
  public:
-  virtual ~FcgiManager() { closeSocket(); }
+  static constexpr size_t kMaxSize = 8;
 
-  virtual int start(const char *addr, int port) = 0;
+  FcgiParams() : FcgiParams(0, 0) {}
 
-  inline int doRead(void *buf, size_t length, int flags = 0) const {
-    return ::recv(fcgifd_, buf, length, flags);
+  FcgiParams(size_t name_length, size_t value_length)
+      : name_length_(name_length), value_length_(value_length) {
+    encode();
   }
 
-  inline int doWrite(void *buf, size_t length, int flags = 0) const {
-    return ::send(fcgifd_, buf, length, flags);
+  const Byte *data() const { return bytes_; }
+  size_t size() const { return size_; }
+
+  size_t name_length() const { return name_length_; }
+  size_t value_length() const { return value_length_; }
+
+  void set_name_length(size_t name_length) {
+    name_length_ = name_length;
+    encode();
   }
 
-  FcgiHeader readHeader() const {
-    FcgiHeader header;
-    doRead(&header, sizeof(header));
-    return header;
+  void set_value_length(size_t value_length) {
+    value_length_ = value_length;
+    encode();
   }
 
-  int startParams(FcgiRole role, bool keep_alive, int request_id) const {
-    FcgiRequestBegin msg{{kTypeBegin, sizeof(FcgiRequestBeginBody), request_id},
-                         {role, keep_alive}};
+  static size_t lengthSize(size_t length) { return length < 0x80 ? 1 : 4; }
+
+  static size_t encodeLength(Byte *out, size_t length) {
+    if (length < 0x80) {
+      out[0] = length;
+      return 1;
+    }
+    out[0] = (length >> 24) | 0x80;
+    out[1] = length >> 16;
+    out[2] = length >> 8;
+    out[3] = length;
+    return 4;
+  }
 
-    return doWrite(&msg, sizeof(msg));
+  // Encodes both lengths into out, which needs room for kMaxSize bytes.
+  static size_t encode(Byte *out, size_t name_length, size_t value_length) {
+    auto size = encodeLength(out, name_length);
+    return size + encodeLength(out + size, value_length);
   }
 
-  int sendParams(const char *key, const char *value, int request_id) const {
-    static constexpr auto kHeaderLength =
-        sizeof(FcgiParams) + sizeof(FcgiHeader);
+  // Decodes one length at pos and moves pos past it. Returns false if the
+  // length runs past end.
+  static bool decodeLength(const Byte *&pos, const Byte *end, size_t *length) {
+    if (pos == end) return false;
+    if ((*pos & 0x80) == 0) {
+      *length = *pos++;
+      return true;
+    }
 
-    auto key_length = strlen(key), value_length = strlen(value),
-         all_length = kHeaderLength + key_length + value_length;
+    if (end - pos < 4) return false;
+    *length = (static_cast<size_t>(pos[0] & 0x7f) << 24) + (pos[1] << 16) +
+              (pos[2] << 8) + pos[3];
+    pos += 4;
+    return true;
+  }
+
+ private:
+  void encode() { size_ = encode(bytes_, name_length_, value_length_); }
 
-    std::unique_ptr<Byte[]> buf(new Byte[all_length]);
-    new (buf.get())
-        FcgiHeader(kTypeParams, key_length + value_length, request_id);
-    new (buf.get() + sizeof(FcgiHeader)) FcgiParams(key_length, value_length);
+  size_t name_length_;
+  size_t value_length_;
+  Byte bytes_[kMaxSize];
+  size_t size_;
+};
 
-    memcpy(buf.get() + kHeaderLength, key, key_length);
-    memcpy(buf.get() + kHeaderLength + key_length, value, value_length);
+// Thread-local cache of fixed-size blocks (8 and 64 KiB) that arenas carve
+// request buffers out of, so steady traffic stops hitting malloc.
+class FcgiSlab {
+ public:
+  static constexpr size_t kSmallBlock = 8 * 1024;
+  static constexpr size_t kLargeBlock = 64 * 1024;
+  static constexpr size_t kMaxCached = 64;
 
-    return doWrite(buf.get(), all_length);
+  static FcgiSlab &local() {
+    static thread_local FcgiSlab slab;
+    return slab;
   }
 
-  int endParams(int requestID) const {
-    FcgiHeader header(kTypeParams, 0, requestID);
-    return doWrite(&header, sizeof(header));
+  FcgiSlab() {}
+  FcgiSlab(const FcgiSlab &) = delete;
+  FcgiSlab &operator=(const FcgiSlab &) = delete;
+
+  ~FcgiSlab() {
+    for (auto block : small_) delete[] block;
+    for (auto block : large_) delete[] block;
   }
 
- protected:
-  inline int fcgifd() const { return fcgifd_; }
-  inline void set_fcgifd(const int fcgifd) { fcgifd_ = fcgifd; }
-  inline void closeSocket() {
-    if (fcgifd_ != -1) close(fcgifd_);
+  // Sizes above kLargeBlock are not cached and come straight from the heap.
+  static size_t blockSize(size_t length) {
+    return length <= kSmallBlock   ? kSmallBlock
+           : length <= kLargeBlock ? kLargeBlock
+                                   : length;
+  }
+
+  Byte *get(size_t size) {
+    auto cache = this->cache(size);
+    if (cache == nullptr || cache->empty()) return new Byte[size];
+    auto block = cache->back();
+    cache->pop_back();
+    return block;
+  }
+
+  void put(Byte *block, size_t size) {
+    auto cache = this->cache(size);
+    if (cache == nullptr || cache->size() >= kMaxCached) {
+      delete[] block;
+      return;
+    }
+    cache->push_back(block);
   }
 
  private:
-  int fcgifd_ = -1;
+  std::vector<Byte *> *cache(size_t size) {
+    return size == kSmallBlock   ? &small_
+           : size == kLargeBlock ? &large_
+                                 : nullptr;
+  }
+
+  std::vector<Byte *> small_;
+  std::vector<Byte *> large_;
+};
+
+// Bump allocator for everything a single request encodes or decodes.
+// Nothing is freed individually; reset() once the request's END_REQUEST has
+// been handled gives all blocks but the first back to the thread's slab.
+// An arena is meant to stay on the thread that created it.
+class FcgiRequestArena {
+ public:
+  FcgiRequestArena() {}
+  FcgiRequestArena(const FcgiRequestArena &) = delete;
+  FcgiRequestArena &operator=(const FcgiRequestArena &) = delete;
+
+  ~FcgiRequestArena() {
+    reset();
+    if (head_ != nullptr) release(head_);
+  }
+
+  void *allocate(size_t length) {
+    length = align(length);
+    if (head_ == nullptr || head_->capacity - head_->used < length)
+      addBlock(length);
+
+    auto ptr = head_->data() + head_->used;
+    head_->used += length;
+    last_ = ptr;
+    return ptr;
+  }
+
+  // Grows the most recent allocation in place when the block has room, and
+  // falls back to allocate and copy otherwise.
+  void *reallocate(void *ptr, size_t length, size_t new_length) {
+    if (ptr != nullptr && ptr == last_) {
+      auto begin = static_cast<Byte *>(ptr) - head_->data();
+      if (head_->capacity - begin >= align(new_length)) {
+        head_->used = begin + align(new_length);
+        return ptr;
+      }
+    }
+
+    auto moved = allocate(new_length);
+    if (length > 0) memcpy(moved, ptr, length);
+    return moved;
+  }
+
+  void reset() {
+    while (head_ != nullptr && head_->next != nullptr) {
+      auto next = head_->next;
+      release(head_);
+      head_ = next;
+    }
+    if (head_ != nullptr) head_->used = 0;
+    last_ = nullptr;
+  }
 
-  // -1 represents END OF REQUEST
-  // 0  represents NO
-  // 1  represents YES
-  // int pkgType(FcgiPreread fp) {
-  //   if (fp.type == FcgiType::END) return -1;
-  //   if (fp.type != FcgiType::STDOUT && fp.type != FcgiType::STDERR) return 0;
-  //   return (fp.contentLength > 0) ? 1 : 0;
-  // }
+ private:
+  // Aligned so that sizeof(Block) is a multiple of the alignment align()
+  // promises, which data() right behind the header then keeps.
+  struct alignas(alignof(std::max_align_t)) Block {
+    Block *next;
+    size_t capacity;
+    size_t used;
+
+    Byte *data() { return reinterpret_cast<Byte *>(this + 1); }
+  };
+
+  static size_t align(size_t length) {
+    return (length + alignof(std::max_align_t) - 1) &
+           ~(alignof(std::max_align_t) - 1);
+  }
 
-  // inline int readContent(FcgiPreread pre, void *buffer) {
-  //   std::shared_ptr<char> padding(new char[pre.paddingLength],
-  //                                 std::default_delete<char[]>());
-  //   return readContent(pre, buffer, padding.get());
-  // }
+  void addBlock(size_t length) {
+    auto size = FcgiSlab::blockSize(length + sizeof(Block));
+    auto block = reinterpret_cast<Block *>(FcgiSlab::local().get(size));
+    block->next = head_;
+    block->capacity = size - sizeof(Block);
+    block->used = 0;
+    head_ = block;
+  }
+
+  static void release(Block *block) {
+    FcgiSlab::local().put(reinterpret_cast<Byte *>(block),
+                          block->capacity + sizeof(Block));
+  }
 
-  // int readContent(FcgiPreread pre, void *buffer, void *paddingBuffer) {
-  //   int res = doRead(buffer, pre.contentLength);
-  //   doRead(paddingBuffer, pre.paddingLength);
-  //   return res;
-  // }
+  Block *head_ = nullptr;
+  void *last_ = nullptr;
 };
 
-class FcgiManagerINET : public FcgiManager {
+// Growable byte buffer for encoded records, backed either by the heap or
+// by a request arena.
+class FcgiBuffer {
  public:
-  FcgiManagerINET(const char *addr, const int port) { start(addr, port); }
-  int start(const char *addr, const int port) override {
-    assert(port >= 0);
-    closeSocket();
+  explicit FcgiBuffer(FcgiRequestArena *arena = nullptr) : arena_(arena) {}
+  FcgiBuffer(const FcgiBuffer &) = delete;
+  FcgiBuffer &operator=(const FcgiBuffer &) = delete;
 
-    sockaddr_in sktaddr;
-    memset(&sktaddr, 0, sizeof(sockaddr_in));
-    sktaddr.sin_family = AF_INET;
-    sktaddr.sin_port = htons(port);
+  ~FcgiBuffer() {
+    if (arena_ == nullptr) delete[] data_;
+  }
 
-    if (inet_pton(AF_INET, addr, &sktaddr.sin_addr) <= 0) {
-      return -1;
+  // Returns room for length more bytes at the end of the buffer.
+  Byte *grow(size_t length) {
+    if (capacity_ - size_ < length) reserve(size_ + length);
+    auto ptr = data_ + size_;
+    size_ += length;
+    return ptr;
+  }
+
+  void append(const void *data, size_t length) {
+    memcpy(grow(length), data, length);
+  }
+
+  void reserve(size_t capacity) {
+    if (capacity <= capacity_) return;
+    if (capacity < capacity_ * 2) capacity = capacity_ * 2;
+
+    if (arena_ != nullptr) {
+      data_ = static_cast<Byte *>(arena_->reallocate(data_, size_, capacity));
+    } else {
+      auto data = new Byte[capacity];
+      if (size_ > 0) memcpy(data, data_, size_);
+      delete[] data_;
+      data_ = data;
     }
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    set_fcgifd(fd);
-    return connect(fd, (sockaddr *)&sktaddr, sizeof(sockaddr_in));
+    capacity_ = capacity;
   }
+
+  void clear() { size_ = 0; }
+  void truncate(size_t size) { size_ = size < size_ ? size : size_; }
+  bool empty() const { return size_ == 0; }
+  Byte *data() { return data_; }
+  const Byte *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  FcgiRequestArena *arena_;
+  Byte *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
 };
 
-class FcgiManagerUnix : public FcgiManager {
+// Turns an HTTP header name into the tail of its CGI variable name:
+// ASCII letters are upper-cased and '-' becomes '_', everything else is
+// kept. Works on 32 (AVX2) or 16 (SSE2, NEON) bytes at a time, with a
+// scalar loop for the rest. out and name may be the same buffer.
+inline void fcgiHeaderNameToCgi(Byte *out, const char *name, size_t length) {
+  auto in = reinterpret_cast<const Byte *>(name);
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1),
+                dash = _mm256_set1_epi8('-'), flip = _mm256_set1_epi8(0x20),
+                swap = _mm256_set1_epi8('-' ^ '_');
+  for (; i + 32 <= length; i += 32) {
+    auto c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    auto lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, a),
+                                  _mm256_cmpgt_epi8(z, c));
+    c = _mm256_sub_epi8(c, _mm256_and_si256(lower, flip));
+    c = _mm256_xor_si256(c, _mm256_and_si256(_mm256_cmpeq_epi8(c, dash), swap));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), c);
+  }
+#elif defined(__SSE2__)
+  const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1),
+                dash = _mm_set1_epi8('-'), flip = _mm_set1_epi8(0x20),
+                swap = _mm_set1_epi8('-' ^ '_');
+  for (; i + 16 <= length; i += 16) {
+    auto c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    auto lower = _mm_and_si128(_mm_cmpgt_epi8(c, a), _mm_cmpgt_epi8(z, c));
+    c = _mm_sub_epi8(c, _mm_and_si128(lower, flip));
+    c = _mm_xor_si128(c, _mm_and_si128(_mm_cmpeq_epi8(c, dash), swap));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), c);
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t a = vdupq_n_u8('a'), z = vdupq_n_u8('z'),
+                   dash = vdupq_n_u8('-'), flip = vdupq_n_u8(0x20),
+                   swap = vdupq_n_u8('-' ^ '_');
+  for (; i + 16 <= length; i += 16) {
+    auto c = vld1q_u8(in + i);
+    auto lower = vandq_u8(vcgeq_u8(c, a), vcleq_u8(c, z));
+    c = vsubq_u8(c, vandq_u8(lower, flip));
+    c = veorq_u8(c, vandq_u8(vceqq_u8(c, dash), swap));
+    vst1q_u8(out + i, c);
+  }
+#endif
+
+  for (; i < length; ++i) {
+    Byte c = in[i];
+    if (c >= 'a' && c <= 'z') c -= 0x20;
+    out[i] = c == '-' ? '_' : c;
+  }
+}
+
+// Writes "HTTP_" and the converted name to out, which needs length + 5
+// bytes. Returns the number of bytes written.
+inline size_t fcgiHttpHeaderToCgi(Byte *out, const char *name, size_t length) {
+  memcpy(out, "HTTP_", 5);
+  fcgiHeaderNameToCgi(out + 5, name, length);
+  return length + 5;
+}
+
+// One request header as handed to FcgiParamsBuilder::addHttpHeaders.
+struct FcgiHttpHeader {
+  const char *name;
+  size_t name_length;
+  const char *value;
+  size_t value_length;
+};
+
+// Name-value pairs encoded once, at startup, and then reused by every
+// request through FcgiParamsBuilder::add(block) without copying.
+class FcgiParamsBlock {
  public:
-  FcgiManagerUnix(const char *path) { start(path); }
+  FcgiParamsBlock() {}
 
-  int start(const char *path, const int padding = 0) override {
-    closeSocket();
+  FcgiParamsBlock &add(const char *name, const char *value) {
+    return add(name, strlen(name), value, strlen(value));
+  }
 
-    sockaddr_un sktaddr;
-    memset(&sktaddr, 0, sizeof(sockaddr_un));
-    sktaddr.sun_family = AF_UNIX;
-    strcpy(sktaddr.sun_path, path);
+#if __cplusplus >= 201703L
+  FcgiParamsBlock &add(std::string_view name, std::string_view value) {
+    return add(name.data(), name.size(), value.data(), value.size());
+  }
+#endif
 
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0),
-        size = offsetof(sockaddr_un, sun_path) + strlen(sktaddr.sun_path);
-    set_fcgifd(fd);
-    return connect(fd, (sockaddr *)&sktaddr, size);
+  FcgiParamsBlock &add(const char *name, size_t name_length, const char *value,
+                       size_t value_length) {
+    FcgiParams params(name_length, value_length);
+    bytes_.insert(bytes_.end(), params.data(), params.data() + params.size());
+    bytes_.insert(bytes_.end(), name, name + name_length);
+    bytes_.insert(bytes_.end(), value, value + value_length);
+    return *this;
+  }
+
+  const Byte *data() const { return bytes_.data(); }
+  size_t size() const { return bytes_.size(); }
+
+ private:
+  std::vector<Byte> bytes_;
+};
+
+#if __cplusplus >= 201402L
+// Name-value pairs encoded at compile time by fcgiStaticParams().
+template <size_t N>
+struct FcgiStaticParams {
+  Byte bytes[N];
+
+  constexpr const Byte *data() const { return bytes; }
+  constexpr size_t size() const { return N; }
+};
+
+template <size_t... L>
+constexpr size_t fcgiStaticParamsSize() {
+  size_t lengths[] = {(L - 1)...}, size = 0;
+  for (auto length : lengths) size += (length < 0x80 ? 1 : 4) + length;
+  return size;
+}
+
+// Encodes alternating names and values given as string literals, e.g.
+//   static constexpr auto kServerParams = fcgiStaticParams(
+//       "GATEWAY_INTERFACE", "CGI/1.1", "SERVER_SOFTWARE", "pfastcgi");
+template <size_t... L>
+constexpr FcgiStaticParams<fcgiStaticParamsSize<L...>()> fcgiStaticParams(
+    const char (&... strings)[L]) {
+  static_assert(sizeof...(L) % 2 == 0, "names and values must pair up");
+
+  FcgiStaticParams<fcgiStaticParamsSize<L...>()> block{};
+  const char *ptrs[] = {strings...};
+  size_t lengths[] = {(L - 1)...}, pos = 0;
+
+  for (size_t i = 0; i < sizeof...(L); i += 2) {
+    for (size_t j = i; j < i + 2; ++j) {
+      auto length = lengths[j];
+      if (length < 0x80) {
+        block.bytes[pos++] = length;
+      } else {
+        block.bytes[pos++] = (length >> 24) | 0x80;
+        block.bytes[pos++] = (length >> 16) & 0xff;
+        block.bytes[pos++] = (length >> 8) & 0xff;
+        block.bytes[pos++] = length & 0xff;
+      }
+    }
+    for (size_t j = i; j < i + 2; ++j)
+      for (size_t k = 0; k < lengths[j]; ++k) block.bytes[pos++] = ptrs[j][k];
+  }
+  return block;
+}
+#endif
+
+// Packs name-value pairs into as few kTypeParams records as possible, so that
+// a whole params stream (terminator included) goes out with a single write.
+// Pairs are appended to the stream as is and split across records only when
+// a record reaches kFcgiMaxContentLength. Pre-encoded blocks are referenced
+// rather than copied and get records of their own.
+class FcgiParamsBuilder {
+ public:
+  static constexpr size_t kInitialCapacity = 4096;
+
+  explicit FcgiParamsBuilder(int request_id = 1,
+                             FcgiRequestArena *arena = nullptr)
+      : buf_(arena), request_id_(request_id) {
+    buf_.reserve(kInitialCapacity);
+  }
+
+  void add(const char *key, const char *value) {
+    add(key, strlen(key), value, strlen(value));
+  }
+
+#if __cplusplus >= 201703L
+  void add(std::string_view key, std::string_view value) {
+    add(key.data(), key.size(), value.data(), value.size());
+  }
+#endif
+
+  // Binary safe: key and value may contain NUL bytes and need no
+  // terminator.
+  void add(const char *key, size_t key_length, const char *value,
+           size_t value_length) {
+    assert(!finished_);
+
+    // Common case: the whole pair fits into the open record, so it is
+    // encoded in place without going through the record splitting.
+    auto length = FcgiParams::lengthSize(key_length) +
+                  FcgiParams::lengthSize(value_length) + key_length +
+                  value_length;
+    if (record_offset_ == kNoRecord) openRecord();
+    if (kFcgiMaxContentLength - recordLength() >= length) {
+      auto out = grow(length);
+      out += FcgiParams::encode(out, key_length, value_length);
+      memcpy(out, key, key_length);
+      memcpy(out + key_length, value, value_length);
+      if (recordLength() == kFcgiMaxContentLength) closeRecord();
+      return;
+    }
+
+    FcgiParams params(key_length, value_length);
+    append(params.data(), params.size());
+    append(key, key_length);
+    append(value, value_length);
+  }
+
+  // Adds the header as HTTP_<NAME> with the name converted straight into
+  // the output buffer. CONTENT_TYPE and CONTENT_LENGTH, which CGI passes
+  // without the prefix, are up to the caller.
+  void addHttpHeader(const char *name, size_t name_length, const char *value,
+                     size_t value_length) {
+    assert(!finished_);
+    auto cgi_length = name_length + 5,
+         prefix = FcgiParams::lengthSize(cgi_length) +
+                  FcgiParams::lengthSize(value_length);
+
+    if (prefix + cgi_length > static_cast<size_t>(kFcgiMaxContentLength)) {
+      std::unique_ptr<Byte[]> cgi(new Byte[cgi_length]);
+      fcgiHttpHeaderToCgi(cgi.get(), name, name_length);
+      add(reinterpret_cast<char *>(cgi.get()), cgi_length, value,
+          value_length);
+      return;
+    }
+
+    // The prefix and name always go into one record; the value may spill.
+    if (record_offset_ == kNoRecord ||
+        kFcgiMaxContentLength - recordLength() < prefix + cgi_length) {
+      closeRecord();
+      openRecord();
+    }
+    auto out = grow(prefix + cgi_length);
+    out += FcgiParams::encode(out, cgi_length, value_length);
+    fcgiHttpHeaderToCgi(out, name, name_length);
+    if (recordLength() == kFcgiMaxContentLength) closeRecord();
+    append(value, value_length);
+  }
+
+  void addHttpHeaders(const FcgiHttpHeader *headers, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+      addHttpHeader(headers[i].name, headers[i].name_length, headers[i].value,
+                    headers[i].value_length);
+  }
+
+  // Adds already encoded name-value pairs. The bytes are sent from where
+  // they are, so they must outlive the builder's last write.
+  void addEncoded(const Byte *data, size_t length) {
+    assert(!finished_);
+    closeRecord();
+    while (length > 0) {
+      size_t chunk = length < static_cast<size_t>(kFcgiMaxContentLength)
+                         ? length
+                         : kFcgiMaxContentLength;
+      new (grow(sizeof(FcgiHeader)))
+          FcgiHeader(kTypeParams, chunk, request_id_);
+      ++records_;
+      segments_.push_back({buf_.size(), data, chunk});
+      external_length_ += chunk;
+      data += chunk;
+      length -= chunk;
+    }
+  }
+
+  template <typename Block>
+  void add(const Block &block) {
+    addEncoded(block.data(), block.size());
+  }
+
+  // Calls fn(const Byte *, size_t) for each piece of the encoded stream in
+  // order; the pieces together are what goes on the wire.
+  template <typename Fn>
+  void forEachSegment(Fn &&fn) const {
+    size_t own = 0;
+    for (auto &segment : segments_) {
+      if (segment.own_end > own) fn(buf_.data() + own, segment.own_end - own);
+      fn(segment.data, segment.length);
+      own = segment.own_end;
+    }
+    if (buf_.size() > own) fn(buf_.data() + own, buf_.size() - own);
+  }
+
+  int segments() const { return static_cast<int>(2 * segments_.size() + 1); }
+  // Number of records in the stream so far.
+  size_t records() const { return records_; }
+
+  // Closes the last record and appends the empty record ending the stream.
+  void finish() {
+    if (finished_) return;
+    closeRecord();
+    new (grow(sizeof(FcgiHeader))) FcgiHeader(kTypeParams, 0, request_id_);
+    ++records_;
+    finished_ = true;
+  }
+
+  void reset(int request_id) {
+    buf_.clear();
+    segments_.clear();
+    external_length_ = 0;
+    records_ = 0;
+    request_id_ = request_id;
+    record_offset_ = kNoRecord;
+    finished_ = false;
+  }
+
+  // Moves the records encoded so far, and all later ones, to another
+  // request id, e.g. once a pipeline has picked the id. Must not be called
+  // while a record is open, which finish() guarantees.
+  void set_request_id(int request_id) {
+    assert(record_offset_ == kNoRecord);
+    size_t offset = 0, segment = 0;
+    while (offset < buf_.size()) {
+      auto header = reinterpret_cast<FcgiHeader *>(buf_.data() + offset);
+      header->set_request_id(request_id);
+      offset += sizeof(FcgiHeader);
+
+      // Content of a referenced block lives outside the buffer.
+      if (segment < segments_.size() && segments_[segment].own_end == offset)
+        ++segment;
+      else
+        offset += header->content_length();
+    }
+    request_id_ = request_id;
+  }
+
+  int request_id() const { return request_id_; }
+  bool finished() const { return finished_; }
+  // data() is the whole stream only when no block was added; otherwise use
+  // forEachSegment(). size() always counts the whole stream.
+  const Byte *data() const {
+    assert(segments_.empty());
+    return buf_.data();
+  }
+  size_t size() const { return buf_.size() + external_length_; }
+
+ private:
+  static constexpr size_t kNoRecord = static_cast<size_t>(-1);
+
+  struct Segment {
+    size_t own_end;  // own bytes up to here precede data
+    const Byte *data;
+    size_t length;
+  };
+
+  Byte *grow(size_t length) { return buf_.grow(length); }
+
+  size_t recordLength() const {
+    return buf_.size() - record_offset_ - sizeof(FcgiHeader);
+  }
+
+  void openRecord() {
+    record_offset_ = buf_.size();
+    grow(sizeof(FcgiHeader));
+  }
+
+  void closeRecord() {
+    if (record_offset_ == kNoRecord) return;
+    if (recordLength() == 0) {
+      buf_.truncate(record_offset_);
+      record_offset_ = kNoRecord;
+      return;
+    }
+    new (buf_.data() + record_offset_)
+        FcgiHeader(kTypeParams, recordLength(), request_id_);
+    ++records_;
+    record_offset_ = kNoRecord;
+  }
+
+  void append(const void *data, size_t length) {
+    auto src = static_cast<const Byte *>(data);
+    while (length > 0) {
+      if (record_offset_ == kNoRecord) openRecord();
+
+      auto room = kFcgiMaxContentLength - recordLength(),
+           chunk = length < room ? length : room;
+      memcpy(grow(chunk), src, chunk);
+      src += chunk;
+      length -= chunk;
+
+      if (recordLength() == kFcgiMaxContentLength) closeRecord();
+    }
+  }
+
+  FcgiBuffer buf_;
+  std::vector<Segment> segments_;
+  size_t external_length_ = 0;
+  size_t records_ = 0;
+  int request_id_;
+  size_t record_offset_ = kNoRecord;
+  bool finished_ = false;
+};
+
+// Walks the name-value pairs of a params stream or a GET_VALUES_RESULT
+// body, decoding both the 1-byte and the 4-byte length forms.
+class FcgiNameValueParser {
+ public:
+  FcgiNameValueParser(const Byte *data, size_t length)
+      : pos_(data), end_(data + length) {}
+
+  // Returns 1 with the next pair, 0 at the end of the body and -1 if the
+  // body ends in the middle of a pair.
+  int next(const Byte **name, size_t *name_length, const Byte **value,
+           size_t *value_length) {
+    if (pos_ == end_) return 0;
+    if (!FcgiParams::decodeLength(pos_, end_, name_length) ||
+        !FcgiParams::decodeLength(pos_, end_, value_length) ||
+        static_cast<size_t>(end_ - pos_) < *name_length + *value_length)
+      return -1;
+
+    *name = pos_;
+    *value = pos_ + *name_length;
+    pos_ += *name_length + *value_length;
+    return 1;
+  }
+
+ private:
+  const Byte *pos_;
+  const Byte *end_;
+};
+
+// Index over an encoded params stream or GET_VALUES body that leaves names
+// and values where they are: one contiguous array of offsets, plus a slot
+// per well-known variable so that get(kScriptFilename) and friends are a
+// single load. When a name repeats, the last occurrence wins, as in CGI.
+// The indexed bytes must stay in place while the view is used.
+class FcgiParamsView {
+ public:
+  enum Key {
+    kGatewayInterface,
+    kServerSoftware,
+    kServerName,
+    kServerAddr,
+    kServerPort,
+    kServerProtocol,
+    kRequestMethod,
+    kRequestScheme,
+    kRequestUri,
+    kDocumentUri,
+    kDocumentRoot,
+    kScriptName,
+    kScriptFilename,
+    kPathInfo,
+    kQueryString,
+    kContentType,
+    kContentLength,
+    kRemoteAddr,
+    kRemotePort,
+    kHttps,
+    kRedirectStatus,
+    kHttpHost,
+    kHttpCookie,
+    kHttpUserAgent,
+    kMaxConns,
+    kMaxReqs,
+    kMpxsConns,
+    kKeyCount
+  };
+
+  struct Entry {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+  };
+
+  FcgiParamsView() { clear(); }
+
+  // Indexes length bytes at data, replacing any previous index. Returns
+  // false if they end in the middle of a pair; the pairs before that are
+  // indexed anyway.
+  bool parse(const Byte *data, size_t length) {
+    clear();
+    base_ = data;
+    FcgiNameValueParser parser(data, length);
+    const Byte *name, *value;
+    size_t name_length, value_length;
+    int res;
+    while ((res = parser.next(&name, &name_length, &value, &value_length)) ==
+           1) {
+      int key = wellKnown(name, name_length);
+      if (key >= 0) slots_[key] = static_cast<uint32_t>(entries_.size()) + 1;
+      entries_.push_back({static_cast<uint32_t>(name - data),
+                          static_cast<uint32_t>(name_length),
+                          static_cast<uint32_t>(value - data),
+                          static_cast<uint32_t>(value_length)});
+    }
+    return res == 0;
+  }
+
+  void clear() {
+    entries_.clear();
+    for (auto &slot : slots_) slot = 0;
+  }
+
+  size_t size() const { return entries_.size(); }
+  const Entry &operator[](size_t i) const { return entries_[i]; }
+
+  // Names and values are not NUL-terminated; use the lengths in Entry.
+  const char *name(const Entry &entry) const {
+    return reinterpret_cast<const char *>(base_) + entry.name_offset;
+  }
+  const char *value(const Entry &entry) const {
+    return reinterpret_cast<const char *>(base_) + entry.value_offset;
+  }
+
+  // Returns the value of a well-known variable, or nullptr without one.
+  const char *get(Key key, size_t *length = nullptr) const {
+    if (slots_[key] == 0) return nullptr;
+    return valueOf(entries_[slots_[key] - 1], length);
+  }
+
+  // Looks up any name: well-known ones through their slot, others by a
+  // scan from the back.
+  const char *find(const char *name, size_t name_length,
+                   size_t *length = nullptr) const {
+    auto bytes = reinterpret_cast<const Byte *>(name);
+    int key = wellKnown(bytes, name_length);
+    if (key >= 0) return get(static_cast<Key>(key), length);
+
+    for (size_t i = entries_.size(); i-- > 0;) {
+      auto &entry = entries_[i];
+      if (entry.name_length == name_length &&
+          memcmp(base_ + entry.name_offset, name, name_length) == 0)
+        return valueOf(entry, length);
+    }
+    return nullptr;
+  }
+
+  const char *find(const char *name, size_t *length = nullptr) const {
+    return find(name, strlen(name), length);
+  }
+
+  // Maps a name to its Key, or -1: one hash of the length and three
+  // characters into a precomputed table, then a single memcmp() in the
+  // common case.
+  static int wellKnown(const Byte *name, size_t length) {
+    static const Table table;
+    if (length == 0 || length > kMaxKeyLength) return -1;
+    for (size_t i = hash(name, length);; i = (i + 1) % kTableSize) {
+      int key = table.keys[i];
+      if (key < 0) return -1;
+      if (table.lengths[key] == length &&
+          memcmp(keyName(static_cast<Key>(key)), name, length) == 0)
+        return key;
+    }
   }
+
+  static const char *keyName(Key key) {
+    static const char *const kNames[kKeyCount] = {
+        "GATEWAY_INTERFACE", "SERVER_SOFTWARE", "SERVER_NAME",
+        "SERVER_ADDR",       "SERVER_PORT",     "SERVER_PROTOCOL",
+        "REQUEST_METHOD",    "REQUEST_SCHEME",  "REQUEST_URI",
+        "DOCUMENT_URI",      "DOCUMENT_ROOT",   "SCRIPT_NAME",
+        "SCRIPT_FILENAME",   "PATH_INFO",       "QUERY_STRING",
+        "CONTENT_TYPE",      "CONTENT_LENGTH",  "REMOTE_ADDR",
+        "REMOTE_PORT",       "HTTPS",           "REDIRECT_STATUS",
+        "HTTP_HOST",         "HTTP_COOKIE",     "HTTP_USER_AGENT",
+        kFcgiMaxConns,       kFcgiMaxReqs,      kFcgiMpxsConns};
+    return kNames[key];
+  }
+
+ private:
+  static constexpr size_t kTableSize = 64;
+  static constexpr size_t kMaxKeyLength = 17;
+
+  // Open addressing over kTableSize slots, filled once.
+  struct Table {
+    Table() {
+      for (auto &key : keys) key = -1;
+      for (int key = 0; key < kKeyCount; ++key) {
+        auto name = keyName(static_cast<Key>(key));
+        lengths[key] = strlen(name);
+        auto i = hash(reinterpret_cast<const Byte *>(name), lengths[key]);
+        while (keys[i] >= 0) i = (i + 1) % kTableSize;
+        keys[i] = static_cast<int8_t>(key);
+      }
+    }
+
+    int8_t keys[kTableSize];
+    size_t lengths[kKeyCount];
+  };
+
+  static size_t hash(const Byte *name, size_t length) {
+    return (length * 31 + name[0] * 7 + name[length / 2] * 3 +
+            name[length - 1]) %
+           kTableSize;
+  }
+
+  const char *valueOf(const Entry &entry, size_t *length) const {
+    if (length != nullptr) *length = entry.value_length;
+    return value(entry);
+  }
+
+  const Byte *base_ = nullptr;
+  std::vector<Entry> entries_;
+  uint32_t slots_[kKeyCount];
+};
+
+// What an upstream reported through GET_VALUES; zero means not reported.
+struct FcgiUpstreamLimits {
+  int max_conns = 0;
+  int max_reqs = 0;
+  bool mpxs_conns = false;
+
+  // Takes the values out of a GET_VALUES_RESULT body. Returns false if
+  // the body is malformed.
+  bool parse(const Byte *data, size_t length) {
+    FcgiParamsView view;
+    if (!view.parse(data, length)) return false;
+
+    int number;
+    if (get(view, FcgiParamsView::kMaxConns, &number)) max_conns = number;
+    if (get(view, FcgiParamsView::kMaxReqs, &number)) max_reqs = number;
+    if (get(view, FcgiParamsView::kMpxsConns, &number))
+      mpxs_conns = number == 1;
+    return true;
+  }
+
+ private:
+  // The leading digits of the value, clamped to INT_MAX since it only
+  // ever caps something; a value without any counts as not reported.
+  static bool get(const FcgiParamsView &view, FcgiParamsView::Key key,
+                  int *number) {
+    size_t length;
+    auto value = view.get(key, &length);
+    if (value == nullptr) return false;
+
+    size_t i = 0;
+    *number = 0;
+    for (; i < length && value[i] >= '0' && value[i] <= '9'; ++i) {
+      int digit = value[i] - '0';
+      *number = *number > (INT_MAX - digit) / 10 ? INT_MAX
+                                                 : *number * 10 + digit;
+    }
+    return i > 0;
+  }
+};
+
+#ifdef PFASTCGI_INSTRUMENTATION
+// Where one request spent its time and what it cost on its connection.
+// Timestamps are steady-clock nanoseconds and stay 0 for phases that did
+// not happen; connect_start and connected are 0 on a reused keep-alive
+// connection. Counters cover everything the connection did since the
+// previous END_REQUEST, so with multiplexing they include the other
+// requests in flight. Sent bytes are counted when records are handed to
+// the connection, header and padding included.
+struct FcgiTrace {
+  static constexpr int kTypes = kTypeUnknown + 1;
+
+  int request_id = 0;
+  int64_t connect_start = 0;
+  int64_t connected = 0;
+  int64_t begin_sent = 0;
+  int64_t params_flushed = 0;
+  int64_t stdin_flushed = 0;
+  int64_t first_stdout = 0;
+  int64_t end_request = 0;
+
+  uint64_t records_sent[kTypes] = {};
+  uint64_t bytes_sent[kTypes] = {};
+  uint64_t records_received[kTypes] = {};
+  uint64_t bytes_received[kTypes] = {};
+  uint64_t syscalls = 0;
+  uint64_t partial_writes = 0;
+
+  static int64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // Last of params_flushed and stdin_flushed, i.e. when the upstream had
+  // the whole request.
+  int64_t flushed() const {
+    return stdin_flushed > params_flushed ? stdin_flushed : params_flushed;
+  }
+};
+
+// Called on END_REQUEST with the trace of the request it ends.
+using FcgiTraceCallback = void (*)(const FcgiTrace &trace, void *context);
+
+// Log2 histogram of durations: bucket 0 counts samples below 1us, bucket
+// i samples in [2^(i-1), 2^i) us, and the last bucket everything above.
+// Only the owning thread records, so counts are plain relaxed stores that
+// other threads may read at any time.
+class FcgiLatencyHistogram {
+ public:
+  static constexpr int kBuckets = 32;
+
+  FcgiLatencyHistogram() {
+    for (auto &count : counts_) count.store(0, std::memory_order_relaxed);
+  }
+
+  FcgiLatencyHistogram(const FcgiLatencyHistogram &) = delete;
+  FcgiLatencyHistogram &operator=(const FcgiLatencyHistogram &) = delete;
+
+  void record(int64_t nanoseconds) {
+    uint64_t micros = nanoseconds > 0 ? nanoseconds / 1000 : 0;
+    int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket >= kBuckets) bucket = kBuckets - 1;
+    bump(counts_[bucket], 1);
+  }
+
+  void add(const FcgiLatencyHistogram &other) {
+    for (int i = 0; i < kBuckets; ++i) bump(counts_[i], other.count(i));
+  }
+
+  uint64_t count(int bucket) const {
+    return counts_[bucket].load(std::memory_order_relaxed);
+  }
+
+  uint64_t total() const {
+    uint64_t sum = 0;
+    for (int i = 0; i < kBuckets; ++i) sum += count(i);
+    return sum;
+  }
+
+  // Upper bound in microseconds of the bucket holding quantile q.
+  uint64_t percentile(double q) const {
+    auto rank = static_cast<uint64_t>(q * total());
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += count(i);
+      if (seen > rank) return 1ull << i;
+    }
+    return 1ull << (kBuckets - 1);
+  }
+
+ private:
+  static void bump(std::atomic<uint64_t> &count, uint64_t n) {
+    count.store(count.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[kBuckets];
+};
+
+// Per-thread phase histograms and totals that every traced request ends up
+// in. A scraper calls collect() from any thread; stats of exited threads
+// are kept.
+class FcgiTraceStats {
+ public:
+  enum Phase {
+    kPhaseConnect,    // connect_start to connected
+    kPhaseSend,       // begin_sent to flushed()
+    kPhaseFirstByte,  // flushed() to first_stdout: FPM queueing and startup
+    kPhaseResponse,   // first_stdout to end_request
+    kPhaseTotal,      // begin_sent to end_request
+    kPhases
+  };
+
+  static FcgiTraceStats &local() {
+    static thread_local Registration registration;
+    return *registration.stats;
+  }
+
+  FcgiTraceStats() {
+    for (auto counter : {&requests_, &syscalls_, &partial_writes_,
+                         &bytes_sent_, &bytes_received_})
+      counter->store(0, std::memory_order_relaxed);
+  }
+
+  FcgiTraceStats(const FcgiTraceStats &) = delete;
+  FcgiTraceStats &operator=(const FcgiTraceStats &) = delete;
+
+  void record(const FcgiTrace &trace) {
+    auto span = [this](Phase phase, int64_t from, int64_t to) {
+      if (from > 0 && to >= from) phases_[phase].record(to - from);
+    };
+    span(kPhaseConnect, trace.connect_start, trace.connected);
+    span(kPhaseSend, trace.begin_sent, trace.flushed());
+    span(kPhaseFirstByte, trace.flushed(), trace.first_stdout);
+    span(kPhaseResponse, trace.first_stdout, trace.end_request);
+    span(kPhaseTotal, trace.begin_sent, trace.end_request);
+
+    uint64_t sent = 0, received = 0;
+    for (int i = 0; i < FcgiTrace::kTypes; ++i) {
+      sent += trace.bytes_sent[i];
+      received += trace.bytes_received[i];
+    }
+    bump(requests_, 1);
+    bump(syscalls_, trace.syscalls);
+    bump(partial_writes_, trace.partial_writes);
+    bump(bytes_sent_, sent);
+    bump(bytes_received_, received);
+  }
+
+  // Adds up the stats of all threads into out, which should be fresh.
+  static void collect(FcgiTraceStats *out) {
+    auto &registry = FcgiTraceStats::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    out->add(*registry.retired);
+    for (auto stats : registry.live) out->add(*stats);
+  }
+
+  const FcgiLatencyHistogram &phase(Phase phase) const {
+    return phases_[phase];
+  }
+  uint64_t requests() const { return load(requests_); }
+  uint64_t syscalls() const { return load(syscalls_); }
+  uint64_t partial_writes() const { return load(partial_writes_); }
+  uint64_t bytes_sent() const { return load(bytes_sent_); }
+  uint64_t bytes_received() const { return load(bytes_received_); }
+
+ private:
+  struct Registry {
+    std::mutex mutex;
+    std::vector<FcgiTraceStats *> live;
+    FcgiTraceStats *retired = new FcgiTraceStats;
+  };
+
+  // Keeps a thread's stats registered while the thread lives and folds
+  // them into the retired totals when it exits.
+  struct Registration {
+    Registration() {
+      auto &registry = FcgiTraceStats::registry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.live.push_back(stats.get());
+    }
+
+    ~Registration() {
+      auto &registry = FcgiTraceStats::registry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.retired->add(*stats);
+      for (auto &live : registry.live)
+        if (live == stats.get()) {
+          live = registry.live.back();
+          registry.live.pop_back();
+          break;
+        }
+    }
+
+    std::unique_ptr<FcgiTraceStats> stats{new FcgiTraceStats};
+  };
+
+  // Never destroyed, so threads outliving static destruction still work.
+  static Registry &registry() {
+    static Registry *registry = new Registry;
+    return *registry;
+  }
+
+  static uint64_t load(const std::atomic<uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+
+  static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(load(counter) + n, std::memory_order_relaxed);
+  }
+
+  void add(const FcgiTraceStats &other) {
+    for (int i = 0; i < kPhases; ++i) phases_[i].add(other.phases_[i]);
+    bump(requests_, other.requests());
+    bump(syscalls_, other.syscalls());
+    bump(partial_writes_, other.partial_writes());
+    bump(bytes_sent_, other.bytes_sent());
+    bump(bytes_received_, other.bytes_received());
+  }
+
+  FcgiLatencyHistogram phases_[kPhases];
+  std::atomic<uint64_t> requests_;
+  std::atomic<uint64_t> syscalls_;
+  std::atomic<uint64_t> partial_writes_;
+  std::atomic<uint64_t> bytes_sent_;
+  std::atomic<uint64_t> bytes_received_;
+};
+#endif  // PFASTCGI_INSTRUMENTATION
+
+// Tuning applied to each socket a manager opens. The TCP options are
+// ignored on Unix sockets. With tcp_fastopen the SYN waits for the first
+// write and carries it, saving a round trip once the kernel holds a
+// cookie for the upstream; connect() then returns at once. coalescing is
+// the high-water mark for FcgiManager::set_coalescing().
+struct FcgiSocketOptions {
+  bool tcp_nodelay = false;
+  bool tcp_fastopen = false;
+  int send_buffer = 0;
+  size_t coalescing = 0;
+};
+
+class FcgiManager {
+ public:
+  virtual ~FcgiManager() { closeSocket(); }
+
+  virtual int start(const char *addr, int port) = 0;
+
+  // Sockets opened by later start() calls are non-blocking: start() then
+  // returns -1 with errno EINPROGRESS and finishConnect() must be called
+  // once the fd turns writable. An open socket is switched as well.
+  inline void set_nonblocking(bool nonblocking) {
+    nonblocking_ = nonblocking;
+    if (fcgifd_ < 0) return;
+    int flags = fcntl(fcgifd_, F_GETFL);
+    fcntl(fcgifd_, F_SETFL,
+          nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+  }
+  inline bool nonblocking() const { return nonblocking_; }
+  inline bool connecting() const { return connecting_; }
+
+  // Bounds every blocking connect, doRead and doWrite on sockets opened by
+  // later start() calls, with SO_SNDTIMEO and SO_RCVTIMEO set once per
+  // socket; 0 waits forever. A timed-out call returns -1 with errno EAGAIN,
+  // or ETIMEDOUT for connect. Non-blocking calls are bounded by
+  // FcgiDeadlines instead.
+  inline void set_io_timeout(int milliseconds) {
+    io_timeout_ = milliseconds;
+  }
+  inline int io_timeout() const { return io_timeout_; }
+
+  // Takes effect on sockets opened by later start() calls, except for
+  // coalescing, which applies at once.
+  inline void set_socket_options(const FcgiSocketOptions &options) {
+    options_ = options;
+    set_coalescing(options.coalescing);
+  }
+
+  // Collects the records of startParams(), sendParams(), endParams(),
+  // sendStdin(), endStdin() and sendStream() in a buffer of the connection
+  // instead of sending each on its own, so that a request goes out in as
+  // few segments as possible. The buffer is sent once it would pass
+  // high_water, flagged MSG_MORE on TCP so that the kernel holds back a
+  // partial segment as TCP_CORK would, and in full, without the flag, by
+  // endStdin(), abortRequest() and sendGetValues(). Larger payloads then
+  // follow it straight from the caller's memory. Every other write on the
+  // connection sends the buffer first. 0, the default, turns it off.
+  //
+  // A record the senders return success for is owned by the connection
+  // and must not be sent again. On a non-blocking socket the buffer may
+  // still hold it: call flush() once the fd is writable until pending()
+  // is 0. On a blocking socket any failure to send, including an expired
+  // set_io_timeout(), is returned as -1 and the connection must be closed.
+  inline void set_coalescing(size_t high_water) { high_water_ = high_water; }
+  inline size_t coalescing() const { return high_water_; }
+
+  // Bytes taken by the coalescing buffer but not yet sent.
+  inline size_t pending() const { return out_.size() - out_sent_; }
+
+  // Sends the coalescing buffer. Returns 0, or -1 if the socket did not
+  // take all of it, e.g. with EAGAIN on a non-blocking one: the rest stays
+  // buffered for the next flush() or write.
+  int flush(bool more = false) const {
+    while (pending() > 0) {
+      auto written = ::send(fcgifd_, out_.data() + out_sent_, pending(),
+                            MSG_NOSIGNAL | (more && tcp_ ? MSG_MORE : 0));
+      traceWrite(written, pending());
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      out_sent_ += written;
+    }
+    out_.clear();
+    out_sent_ = 0;
+    return 0;
+  }
+  inline const FcgiSocketOptions &socket_options() const { return options_; }
+  inline int fd() const { return fcgifd_; }
+
+  // Cheap check that an idle keep-alive connection is still usable: the
+  // peer has not closed it and has not left unexpected bytes behind.
+  bool alive() const {
+    if (fcgifd_ < 0 || connecting_) return false;
+    Byte byte;
+    auto res = ::recv(fcgifd_, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  // Completes a connect started in non-blocking mode. Returns 0 on success
+  // and -1 with errno set to the connect error otherwise.
+  int finishConnect() {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fcgifd_, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+      return -1;
+
+    if (error == 0) {
+      connecting_ = false;
+      traceConnected();
+      return 0;
+    }
+    errno = error;
+    return -1;
+  }
+
+  inline int doRead(void *buf, size_t length, int flags = 0) const {
+    traceSyscall();
+    return ::recv(fcgifd_, buf, length, flags);
+  }
+
+  // Writes never raise SIGPIPE: MSG_NOSIGNAL is always added, and a peer
+  // that went away shows up as EPIPE.
+  inline int doWrite(const void *buf, size_t length, int flags = 0) const {
+    if (pending() > 0 && flush(true) < 0) return -1;
+    auto written = ::send(fcgifd_, buf, length, flags | MSG_NOSIGNAL);
+    traceWrite(written, length);
+    return written;
+  }
+
+  // Gathers iov into as few sendmsg() calls as possible and keeps going on
+  // partial writes until everything is sent. iov is consumed in place: on
+  // return the entries describe what was left unsent. Returns the number of
+  // bytes written, or -1 if nothing could be written.
+  ssize_t doWritev(iovec *iov, int iovcnt, int flags = 0) const {
+    if (pending() > 0 && flush(true) < 0) return -1;
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+      if (iov->iov_len == 0) {
+        ++iov, --iovcnt;
+        continue;
+      }
+
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+      auto written = ::sendmsg(fcgifd_, &msg, flags | MSG_NOSIGNAL);
+      traceSyscall();
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return total > 0 ? total : -1;
+      }
+      total += written;
+
+      for (size_t n = written; n > 0;) {
+        if (n < iov->iov_len) {
+          iov->iov_base = static_cast<Byte *>(iov->iov_base) + n;
+          iov->iov_len -= n;
+          break;
+        }
+        n -= iov->iov_len;
+        iov->iov_len = 0;
+        ++iov, --iovcnt;
+      }
+      if (iovcnt > 0) tracePartialWrite();
+    }
+    return total;
+  }
+
+  FcgiHeader readHeader() const {
+    FcgiHeader header;
+    doRead(&header, sizeof(header));
+    return header;
+  }
+
+  int startParams(FcgiRole role, bool keep_alive, int request_id) const {
+    FcgiRequestBegin msg{{kTypeBegin, sizeof(FcgiRequestBeginBody), request_id},
+                         {role, keep_alive}};
+
+    iovec iov[] = {{&msg, sizeof(msg)}};
+    traceBegin(request_id);
+    traceSent(kTypeBegin, 1, sizeof(msg));
+    return emit(iov, 1);
+  }
+
+  int sendParams(const char *key, const char *value, int request_id) const {
+    return sendParams(key, strlen(key), value, strlen(value), request_id);
+  }
+
+#if __cplusplus >= 201703L
+  int sendParams(std::string_view key, std::string_view value,
+                 int request_id) const {
+    return sendParams(key.data(), key.size(), value.data(), value.size(),
+                      request_id);
+  }
+#endif
+
+  int sendParams(const char *key, size_t key_length, const char *value,
+                 size_t value_length, int request_id) const {
+    FcgiParams params(key_length, value_length);
+    FcgiHeader header(kTypeParams, params.size() + key_length + value_length,
+                      request_id);
+
+    iovec iov[] = {{&header, sizeof(header)},
+                   {const_cast<Byte *>(params.data()), params.size()},
+                   {const_cast<char *>(key), key_length},
+                   {const_cast<char *>(value), value_length}};
+    traceSent(kTypeParams, 1, sizeof(header) + header.content_length());
+    return emit(iov, 4);
+  }
+
+  int endParams(int requestID) const {
+    FcgiHeader header(kTypeParams, 0, requestID);
+    iovec iov[] = {{&header, sizeof(header)}};
+    traceSent(kTypeParams, 1, sizeof(header));
+    auto res = emit(iov, 1);
+    traceParamsFlushed();
+    return res;
+  }
+
+  // Sends a whole params stream, including its terminating record, at once.
+  int sendParams(FcgiParamsBuilder &builder) const {
+    static constexpr int kStackSegments = 16;
+    builder.finish();
+
+    iovec stack_iov[kStackSegments];
+    std::unique_ptr<iovec[]> heap_iov;
+    auto iov = stack_iov;
+    if (builder.segments() > kStackSegments) {
+      heap_iov.reset(new iovec[builder.segments()]);
+      iov = heap_iov.get();
+    }
+
+    int iovcnt = 0;
+    builder.forEachSegment([&](const Byte *data, size_t length) {
+      iov[iovcnt++] = {const_cast<Byte *>(data), length};
+    });
+    traceSent(kTypeParams, builder.records(), builder.size());
+    auto res = emit(iov, iovcnt);
+    traceParamsFlushed();
+    return res;
+  }
+
+  // Padding that brings content_length up to a multiple of 8 bytes.
+  static int paddingFor(size_t content_length) {
+    return (8 - (content_length & 7)) & 7;
+  }
+
+  // Sends a body as padded STDIN records, several records per sendmsg().
+  // Blocks until everything is written; see FcgiStdinStream for streaming
+  // with backpressure. Returns the number of body bytes sent or -1.
+  ssize_t sendStdin(int request_id, const void *data, size_t length) const {
+    return sendStream(kTypeStdin, request_id, data, length);
+  }
+
+  int endStdin(int request_id) const {
+    FcgiHeader header(kTypeStdin, 0, request_id);
+    iovec iov[] = {{&header, sizeof(header)}};
+    traceSent(kTypeStdin, 1, sizeof(header));
+    auto res = emit(iov, 1, true);
+    traceStdinFlushed();
+    return res;
+  }
+
+  // Sends data as padded records of a stream type (STDIN, STDOUT, STDERR
+  // or DATA), several records per sendmsg(), without the terminating empty
+  // record. Returns the number of data bytes sent or -1.
+  ssize_t sendStream(FcgiType type, int request_id, const void *data,
+                     size_t length) const {
+    static constexpr int kRecordsPerCall = 16;
+    auto src = static_cast<const Byte *>(data);
+    size_t sent = 0;
+
+    while (sent < length) {
+      FcgiHeader headers[kRecordsPerCall];
+      iovec iov[kRecordsPerCall * 3];
+      int iovcnt = 0;
+      size_t batch = 0, bytes = 0;
+
+      for (int i = 0; i < kRecordsPerCall && sent + batch < length; ++i) {
+        size_t chunk = length - sent - batch;
+        if (chunk > static_cast<size_t>(kFcgiMaxContentLength))
+          chunk = kFcgiMaxContentLength;
+        int padding = paddingFor(chunk);
+
+        headers[i] = FcgiHeader(type, chunk, request_id, padding);
+        iov[iovcnt++] = {&headers[i], sizeof(FcgiHeader)};
+        iov[iovcnt++] = {const_cast<Byte *>(src + sent + batch), chunk};
+        iov[iovcnt++] = {const_cast<Byte *>(kFcgiPadding),
+                         static_cast<size_t>(padding)};
+        batch += chunk;
+        bytes += sizeof(FcgiHeader) + chunk + padding;
+        traceSent(type, 1, sizeof(FcgiHeader) + chunk + padding);
+      }
+
+      if (emit(iov, iovcnt) != static_cast<ssize_t>(bytes)) return -1;
+      sent += batch;
+    }
+    return sent;
+  }
+
+  // Tells the upstream to drop a request. The connection stays usable: the
+  // upstream still ends the request with END_REQUEST, and records up to
+  // that one should be drained. Must not be sent in the middle of another
+  // record on the same connection.
+  int abortRequest(int request_id) const {
+    FcgiHeader header(kTypeAbort, 0, request_id);
+    iovec iov[] = {{&header, sizeof(header)}};
+    traceSent(kTypeAbort, 1, sizeof(header));
+    return emit(iov, 1, true);
+  }
+
+  // Asks for FCGI_MAX_CONNS, FCGI_MAX_REQS and FCGI_MPXS_CONNS in one
+  // GET_VALUES record.
+  int sendGetValues() const {
+    Byte body[64];
+    size_t length = 0;
+    for (auto name : {kFcgiMaxConns, kFcgiMaxReqs, kFcgiMpxsConns}) {
+      auto name_length = strlen(name);
+      length += FcgiParams::encode(body + length, name_length, 0);
+      memcpy(body + length, name, name_length);
+      length += name_length;
+    }
+
+    FcgiHeader header(kTypeGetValues, length, 0);
+    iovec iov[] = {{&header, sizeof(header)}, {body, length}};
+    traceSent(kTypeGetValues, 1, sizeof(header) + length);
+    return emit(iov, 2, true) < 0 ? -1 : 0;
+  }
+
+  // Sends GET_VALUES and blocks for the answer. It reads straight from the
+  // socket, so no request may be in flight on the connection.
+  int getValues(FcgiUpstreamLimits *limits) const {
+    if (sendGetValues() < 0) return -1;
+
+    for (;;) {
+      FcgiHeader header;
+      if (readFully(&header, sizeof(header)) < 0) return -1;
+      if (header.version != kFcgiVersion) {
+        errno = EPROTO;
+        return -1;
+      }
+
+      size_t length = header.content_length() + header.padding_length;
+      std::unique_ptr<Byte[]> body(new Byte[length > 0 ? length : 1]);
+      if (readFully(body.get(), length) < 0) return -1;
+      traceReceived(header.type, 0, sizeof(header) + length);
+
+      if (header.type == kTypeValueResult) {
+        if (limits->parse(body.get(), header.content_length())) return 0;
+        errno = EPROTO;
+        return -1;
+      }
+    }
+  }
+
+  // Instrumentation hooks. The senders above, the readers and the streams
+  // call them; without PFASTCGI_INSTRUMENTATION they are empty and compile
+  // away.
+#ifdef PFASTCGI_INSTRUMENTATION
+  // Trace of the request started last, or being connected for.
+  const FcgiTrace &trace() const { return trace_; }
+
+  // Requests are also recorded into FcgiTraceStats::local() of the thread
+  // that reads their END_REQUEST.
+  void set_trace_callback(FcgiTraceCallback callback, void *context) {
+    trace_callback_ = callback;
+    trace_context_ = context;
+  }
+
+  void traceConnectStart() const { trace_.connect_start = FcgiTrace::now(); }
+  void traceConnected() const { trace_.connected = FcgiTrace::now(); }
+  void traceSyscall() const { ++trace_.syscalls; }
+  void tracePartialWrite() const { ++trace_.partial_writes; }
+
+  void traceWrite(ssize_t written, size_t length) const {
+    traceSyscall();
+    if (written >= 0 && static_cast<size_t>(written) < length)
+      tracePartialWrite();
+  }
+
+  void traceBegin(int request_id) const {
+    trace_.request_id = request_id;
+    trace_.begin_sent = FcgiTrace::now();
+  }
+
+  void traceParamsFlushed() const { trace_.params_flushed = FcgiTrace::now(); }
+  void traceStdinFlushed() const { trace_.stdin_flushed = FcgiTrace::now(); }
+
+  void traceSent(int type, size_t records, size_t bytes) const {
+    if (type < 0 || type >= FcgiTrace::kTypes) type = kTypeUnknown;
+    trace_.records_sent[type] += records;
+    trace_.bytes_sent[type] += bytes;
+  }
+
+  // bytes is the whole record on the wire. STDOUT of the traced request
+  // marks its first byte and END_REQUEST reports and restarts the trace.
+  void traceReceived(int type, int request_id, size_t bytes) const {
+    if (type < 0 || type >= FcgiTrace::kTypes) type = kTypeUnknown;
+    ++trace_.records_received[type];
+    trace_.bytes_received[type] += bytes;
+    if (request_id != trace_.request_id || request_id == 0) return;
+
+    if (type == kTypeStdout && trace_.first_stdout == 0)
+      trace_.first_stdout = FcgiTrace::now();
+    if (type == kTypeEnd) {
+      trace_.end_request = FcgiTrace::now();
+      FcgiTraceStats::local().record(trace_);
+      if (trace_callback_ != nullptr) trace_callback_(trace_, trace_context_);
+      trace_ = FcgiTrace();
+    }
+  }
+#else
+  void traceConnectStart() const {}
+  void traceConnected() const {}
+  void traceSyscall() const {}
+  void tracePartialWrite() const {}
+  void traceWrite(ssize_t, size_t) const {}
+  void traceBegin(int) const {}
+  void traceParamsFlushed() const {}
+  void traceStdinFlushed() const {}
+  void traceSent(int, size_t, size_t) const {}
+  void traceReceived(int, int, size_t) const {}
+#endif
+
+ protected:
+  inline int fcgifd() const { return fcgifd_; }
+  inline void set_fcgifd(const int fcgifd) { fcgifd_ = fcgifd; }
+  inline void closeSocket() {
+    if (fcgifd_ != -1) close(fcgifd_);
+    fcgifd_ = -1;
+    connecting_ = false;
+    out_.clear();
+    out_sent_ = 0;
+  }
+
+  int openSocket(int domain) {
+    int type = SOCK_STREAM | (nonblocking_ ? SOCK_NONBLOCK : 0),
+        fd = socket(domain, type, 0);
+    set_fcgifd(fd);
+    tcp_ = domain != AF_UNIX;
+    if (fd < 0) return fd;
+
+    if (io_timeout_ > 0) {
+      timeval timeout = {io_timeout_ / 1000, (io_timeout_ % 1000) * 1000};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    if (options_.send_buffer > 0)
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options_.send_buffer,
+                 sizeof(options_.send_buffer));
+    if (tcp_) {
+      int one = 1;
+      if (options_.tcp_nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef TCP_FASTOPEN_CONNECT
+      if (options_.tcp_fastopen)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+#endif
+    }
+    return fd;
+  }
+
+  int readFully(void *buf, size_t length) const {
+    for (size_t done = 0; done < length;) {
+      auto received = doRead(static_cast<Byte *>(buf) + done, length - done);
+      if (received < 0 && errno == EINTR) continue;
+      if (received <= 0) return -1;
+      done += received;
+    }
+    return 0;
+  }
+
+  // Sends iov, or with coalescing on, adds it to the buffer, and sends
+  // the buffer when it would pass the high-water mark or when end is set.
+  // iov that does not fit under the mark is sent directly behind the
+  // buffered bytes. Returns the bytes taken, or -1. With coalescing, all
+  // or nothing is taken: a non-blocking socket that is full leaves the
+  // rest in the buffer for flush(), any other failure returns -1.
+  ssize_t emit(iovec *iov, int iovcnt, bool end = false) const {
+    if (high_water_ == 0) return doWritev(iov, iovcnt);
+
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; ++i) length += iov[i].iov_len;
+    if (pending() + length <= high_water_) {
+      buffer(iov, iovcnt);
+      if (!end || flush() == 0 || wouldBlock()) return length;
+      return -1;
+    }
+
+    if (flush(true) < 0) {
+      if (!wouldBlock()) return -1;
+      buffer(iov, iovcnt);
+      return length;
+    }
+
+    auto written = doWritev(iov, iovcnt, end || !tcp_ ? 0 : MSG_MORE);
+    if (written == static_cast<ssize_t>(length)) return length;
+    if (!wouldBlock()) return -1;
+    buffer(iov, iovcnt);
+    return length;
+  }
+
+  // EAGAIN from a non-blocking socket only; on a blocking one it means
+  // SO_SNDTIMEO expired.
+  bool wouldBlock() const {
+    return nonblocking_ && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  void buffer(const iovec *iov, int iovcnt) const {
+    for (int i = 0; i < iovcnt; ++i)
+      if (iov[i].iov_len > 0) out_.append(iov[i].iov_base, iov[i].iov_len);
+  }
+
+  int connectSocket(const sockaddr *addr, socklen_t length) {
+    traceConnectStart();
+    int res = connect(fcgifd_, addr, length);
+    if (res < 0 && errno == EINPROGRESS && !nonblocking_) errno = ETIMEDOUT;
+    connecting_ = res < 0 && errno == EINPROGRESS;
+    if (res == 0) traceConnected();
+    return res;
+  }
+
+ private:
+  int fcgifd_ = -1;
+  int io_timeout_ = 0;
+  FcgiSocketOptions options_;
+  size_t high_water_ = 0;
+  mutable FcgiBuffer out_;
+  mutable size_t out_sent_ = 0;
+  bool tcp_ = false;
+  bool nonblocking_ = false;
+  bool connecting_ = false;
+#ifdef PFASTCGI_INSTRUMENTATION
+  mutable FcgiTrace trace_;
+  FcgiTraceCallback trace_callback_ = nullptr;
+  void *trace_context_ = nullptr;
+#endif
+};
+
+class FcgiManagerINET : public FcgiManager {
+ public:
+  FcgiManagerINET() {}
+  FcgiManagerINET(const char *addr, const int port, bool nonblocking = false) {
+    set_nonblocking(nonblocking);
+    start(addr, port);
+  }
+
+  int start(const char *addr, const int port) override {
+    assert(port >= 0);
+    closeSocket();
+
+    sockaddr_in sktaddr;
+    memset(&sktaddr, 0, sizeof(sockaddr_in));
+    sktaddr.sin_family = AF_INET;
+    sktaddr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, addr, &sktaddr.sin_addr) <= 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (openSocket(AF_INET) < 0) return -1;
+    return connectSocket((sockaddr *)&sktaddr, sizeof(sockaddr_in));
+  }
+};
+
+class FcgiManagerUnix : public FcgiManager {
+ public:
+  FcgiManagerUnix() {}
+  FcgiManagerUnix(const char *path, bool nonblocking = false) {
+    set_nonblocking(nonblocking);
+    start(path);
+  }
+
+  // Fails with ENAMETOOLONG on a path that does not fit sun_path.
+  int start(const char *path, const int padding = 0) override {
+    closeSocket();
+
+    sockaddr_un sktaddr;
+    memset(&sktaddr, 0, sizeof(sockaddr_un));
+    sktaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sktaddr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(sktaddr.sun_path, path);
+
+    int size = offsetof(sockaddr_un, sun_path) + strlen(sktaddr.sun_path);
+    if (openSocket(AF_UNIX) < 0) return -1;
+    return connectSocket((sockaddr *)&sktaddr, size);
+  }
+};
+
+// One record as seen by FcgiResponseReader. content points into the reader's
+// receive buffer and stays valid until the reader is asked for more bytes.
+struct FcgiRecord {
+  int type;
+  int request_id;
+  const Byte *content;
+  size_t content_length;
+
+  const FcgiRequestEndBody *end() const {
+    if (type != kTypeEnd || content_length < sizeof(FcgiRequestEndBody))
+      return nullptr;
+    return reinterpret_cast<const FcgiRequestEndBody *>(content);
+  }
+
+  int app_status() const { return end() ? end()->app_status() : 0; }
+  int protocol_status() const { return end() ? end()->protocol_status : 0; }
+};
+
+// Compact index entry built by fcgiScanRecords. offset is where the content
+// starts, relative to the scanned buffer.
+struct FcgiRecordDesc {
+  uint32_t offset;
+  uint16_t length;
+  uint16_t request_id;
+  uint8_t type;
+};
+
+// Indexes the complete records at the start of buf in one pass and returns
+// how many descriptors were written (at most max). *consumed is set to the
+// bytes they cover, padding included. Scanning stops early, with *corrupt
+// set, at a header whose version is not kFcgiVersion.
+//
+// Each header is decoded with one 8-byte load and shifts, so the only
+// branches are the loop bounds; the next header's offset depends on the
+// current one, which is why this is not spread over SIMD lanes.
+inline size_t fcgiScanRecords(const Byte *buf, size_t length,
+                              FcgiRecordDesc *out, size_t max,
+                              size_t *consumed, bool *corrupt = nullptr) {
+  size_t pos = 0, count = 0;
+  bool bad = false;
+
+  while (count < max && length - pos >= sizeof(FcgiHeader)) {
+    uint64_t word;
+    memcpy(&word, buf + pos, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    // Big-endian view: version, type, id1, id0, len1, len0, padding, -.
+    uint32_t version = word >> 56, type = (word >> 48) & 0xff,
+             request_id = (word >> 32) & 0xffff,
+             content = (word >> 16) & 0xffff, padding = (word >> 8) & 0xff;
+    size_t total = sizeof(FcgiHeader) + content + padding;
+
+    bad = version != kFcgiVersion;
+    if (bad || length - pos < total) break;
+
+    out[count++] = {static_cast<uint32_t>(pos + sizeof(FcgiHeader)),
+                    static_cast<uint16_t>(content),
+                    static_cast<uint16_t>(request_id),
+                    static_cast<uint8_t>(type)};
+    pos += total;
+  }
+
+  *consumed = pos;
+  if (corrupt != nullptr) *corrupt = bad;
+  return count;
+}
+
+// Incremental parser for the CGI header block at the start of a STDOUT
+// stream. Feed it STDOUT content as it arrives, in records of any size;
+// each feed() takes only the header bytes, so the rest of the span is body
+// and can be passed on where it is. Only the header lines are copied, into
+// a buffer of the parser's own, since they may span records that the
+// reader has already recycled. Lines may end in "\r\n" or "\n".
+class FcgiResponseHeaders {
+ public:
+  static constexpr size_t kDefaultLimit = 64 * 1024;
+
+  explicit FcgiResponseHeaders(size_t limit = kDefaultLimit)
+      : limit_(limit) {}
+
+  // Takes header bytes from the front of data. Returns how many were taken,
+  // which is less than length once the blank line ending the headers was
+  // seen, and 0 after that. Returns -1 with errno EPROTO on a line without
+  // a colon or a Content-Length that is not a number a long long holds,
+  // and EMSGSIZE if the headers exceed the limit.
+  ssize_t feed(const Byte *data, size_t length) {
+    size_t pos = 0;
+    while (!done_ && pos < length) {
+      auto left = length - pos;
+      auto newline = static_cast<const Byte *>(memchr(data + pos, '\n', left));
+      size_t take = newline != nullptr ? newline - (data + pos) + 1 : left;
+      if (buf_.size() + take > limit_) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+
+      buf_.insert(buf_.end(), data + pos, data + pos + take);
+      pos += take;
+      if (newline != nullptr && !endLine()) {
+        errno = EPROTO;
+        return -1;
+      }
+    }
+    return static_cast<ssize_t>(pos);
+  }
+
+  // Strips header bytes off a STDOUT span, leaving *data and *length on
+  // the body part, which is empty while the headers are incomplete.
+  // Returns what feed() does.
+  ssize_t feed(const Byte **data, size_t *length) {
+    auto taken = feed(*data, *length);
+    if (taken > 0) {
+      *data += taken;
+      *length -= taken;
+    }
+    return taken;
+  }
+
+  // Forgets everything, e.g. to reuse the parser for another request.
+  void reset() {
+    buf_.clear();
+    lines_.clear();
+    headers_.clear();
+    line_start_ = 0;
+    done_ = false;
+    status_ = 200;
+    content_type_ = -1;
+    content_length_ = -1;
+  }
+
+  // True once the blank line was seen; the accessors below are only
+  // meaningful from then on.
+  bool done() const { return done_; }
+
+  // Where the body starts in the STDOUT stream.
+  size_t body_offset() const { return buf_.size(); }
+
+  // The header lines in order, with names and values trimmed. They point
+  // into the parser and are not NUL-terminated.
+  size_t size() const { return headers_.size(); }
+  const FcgiHttpHeader &operator[](size_t i) const { return headers_[i]; }
+
+  // Returns the value of the first header called name, compared without
+  // regard to case, or nullptr without one.
+  const char *find(const char *name, size_t *length = nullptr) const {
+    auto name_length = strlen(name);
+    for (auto &header : headers_)
+      if (equals(header.name, header.name_length, name, name_length))
+        return valueOf(header, length);
+    return nullptr;
+  }
+
+  // From the Status header, else 302 with a Location header and 200
+  // without.
+  int status() const { return status_; }
+
+  const char *content_type(size_t *length = nullptr) const {
+    if (content_type_ < 0) return nullptr;
+    return valueOf(headers_[content_type_], length);
+  }
+
+  // -1 if the response did not say.
+  long long content_length() const { return content_length_; }
+
+ private:
+  struct Line {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+  };
+
+  // Indexes the line that the last byte of buf_ ended.
+  bool endLine() {
+    size_t start = line_start_, end = buf_.size() - 1;
+    line_start_ = buf_.size();
+    if (end > start && buf_[end - 1] == '\r') --end;
+    if (end == start) return finish();
+
+    auto colon = static_cast<const char *>(memchr(&buf_[start], ':',
+                                                  end - start));
+    if (colon == nullptr) return false;
+    size_t name_end = colon - buf_.data(), value_start = name_end + 1;
+    while (name_end > start && isBlank(buf_[name_end - 1])) --name_end;
+    while (value_start < end && isBlank(buf_[value_start])) ++value_start;
+    while (end > value_start && isBlank(buf_[end - 1])) --end;
+
+    lines_.push_back({static_cast<uint32_t>(start),
+                      static_cast<uint32_t>(name_end - start),
+                      static_cast<uint32_t>(value_start),
+                      static_cast<uint32_t>(end - value_start)});
+    return true;
+  }
+
+  // Resolves the index into pointers, now that buf_ no longer grows, and
+  // picks out the headers that have accessors of their own. Returns false
+  // on a malformed Content-Length.
+  bool finish() {
+    done_ = true;
+    bool location = false, status = false;
+    for (auto &line : lines_) {
+      FcgiHttpHeader header = {&buf_[line.name_offset], line.name_length,
+                               &buf_[line.value_offset], line.value_length};
+      auto name = header.name;
+      auto length = header.name_length;
+
+      if (!status && equals(name, length, "Status", 6)) {
+        status = true;
+        status_ = 0;
+        for (size_t i = 0; i < header.value_length && i < 3; ++i) {
+          if (header.value[i] < '0' || header.value[i] > '9') break;
+          status_ = status_ * 10 + (header.value[i] - '0');
+        }
+      } else if (content_type_ < 0 && equals(name, length, "Content-Type",
+                                             12)) {
+        content_type_ = static_cast<int>(headers_.size());
+      } else if (content_length_ < 0 &&
+                 equals(name, length, "Content-Length", 14)) {
+        if (!parseLength(header.value, header.value_length)) return false;
+      } else if (equals(name, length, "Location", 8)) {
+        location = true;
+      }
+      headers_.push_back(header);
+    }
+    if (!status && location) status_ = 302;
+    return true;
+  }
+
+  // Digits only, and no more than a long long holds.
+  bool parseLength(const char *value, size_t length) {
+    if (length == 0) return false;
+    long long number = 0;
+    for (size_t i = 0; i < length; ++i) {
+      if (value[i] < '0' || value[i] > '9') return false;
+      int digit = value[i] - '0';
+      if (number > (LLONG_MAX - digit) / 10) return false;
+      number = number * 10 + digit;
+    }
+    content_length_ = number;
+    return true;
+  }
+
+  static bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+  static bool equals(const char *a, size_t a_length, const char *b,
+                     size_t b_length) {
+    if (a_length != b_length) return false;
+    for (size_t i = 0; i < a_length; ++i)
+      if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+    return true;
+  }
+
+  static const char *valueOf(const FcgiHttpHeader &header, size_t *length) {
+    if (length != nullptr) *length = header.value_length;
+    return header.value;
+  }
+
+  size_t limit_;
+  std::vector<char> buf_;
+  std::vector<Line> lines_;
+  std::vector<FcgiHttpHeader> headers_;
+  size_t line_start_ = 0;
+  bool done_ = false;
+  int status_ = 200;
+  int content_type_ = -1;
+  long long content_length_ = -1;
+};
+
+// Reads records off an FcgiManager connection into one large receive buffer
+// and hands them out as spans, so neither content nor padding is ever copied
+// into a buffer of its own.
+class FcgiResponseReader {
+ public:
+  static constexpr size_t kDefaultCapacity = 128 * 1024;
+
+  explicit FcgiResponseReader(const FcgiManager &manager,
+                              size_t capacity = kDefaultCapacity)
+      : manager_(manager),
+        capacity_(capacity < kFcgiMaxRecordLength ? kFcgiMaxRecordLength
+                                                  : capacity),
+        buf_(new Byte[capacity_]) {}
+
+  FcgiResponseReader(const FcgiResponseReader &) = delete;
+  FcgiResponseReader &operator=(const FcgiResponseReader &) = delete;
+
+  ~FcgiResponseReader() {
+    if (pipe_[0] >= 0) close(pipe_[0]);
+    if (pipe_[1] >= 0) close(pipe_[1]);
+  }
+
+  // Takes the next complete record out of the buffer without doing any I/O.
+  // Returns 1 if a record was parsed, 0 if more bytes are needed and -1 if
+  // the stream is not FastCGI.
+  int parse(FcgiRecord *record) {
+    if (buffered() < sizeof(FcgiHeader)) return 0;
+
+    FcgiHeader header;
+    memcpy(&header, buf_.get() + begin_, sizeof(header));
+    if (header.version != kFcgiVersion) {
+      errno = EPROTO;
+      return -1;
+    }
+
+    size_t length = header.content_length(),
+           total = sizeof(header) + length + header.padding_length;
+    if (buffered() < total) return 0;
+
+    record->type = header.type;
+    record->request_id = header.request_id();
+    record->content = buf_.get() + begin_ + sizeof(header);
+    record->content_length = length;
+
+    begin_ += total;
+    manager_.traceReceived(record->type, record->request_id, total);
+    return 1;
+  }
+
+  // Receives more bytes from the connection, moving a trailing partial
+  // record to the front first if it might not fit. Returns what doRead does,
+  // or -1 with errno ENOBUFS if the buffer is full of unparsed records.
+  ssize_t fill() {
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    } else if (capacity_ - begin_ < kFcgiMaxRecordLength) {
+      memmove(buf_.get(), buf_.get() + begin_, buffered());
+      end_ -= begin_;
+      begin_ = 0;
+    }
+
+    if (end_ == capacity_) {
+      errno = ENOBUFS;
+      return -1;
+    }
+
+    ssize_t received;
+    do {
+      received = manager_.doRead(buf_.get() + end_, capacity_ - end_);
+    } while (received < 0 && errno == EINTR);
+
+    if (received > 0) end_ += received;
+    return received;
+  }
+
+  // Blocks until the next record arrives. Returns 1 on a record, 0 once the
+  // peer has closed the connection and -1 on errors.
+  int next(FcgiRecord *record) {
+    for (;;) {
+      int parsed = parse(record);
+      if (parsed != 0) return parsed;
+
+      auto received = fill();
+      if (received <= 0) return received;
+    }
+  }
+
+  // Discards records until the END_REQUEST of request_id, e.g. after
+  // abortRequest(). Returns 1 once it was seen, otherwise what next() does.
+  int drain(int request_id) {
+    FcgiRecord record;
+    int res;
+    while ((res = next(request_id, &record)) == 1)
+      if (record.type == kTypeEnd) return 1;
+    return res;
+  }
+
+  // Like next(), but skips records that do not belong to request_id.
+  int next(int request_id, FcgiRecord *record) {
+    int result;
+    while ((result = next(record)) == 1 && record->request_id != request_id) {
+    }
+    return result;
+  }
+
+  // Like next(request_id, record), but runs STDOUT content through
+  // headers until they are done and leaves record on the body part, in
+  // place; STDOUT records holding only headers are not returned. Returns
+  // -1 with the errno of FcgiResponseHeaders::feed() on bad headers.
+  int next(int request_id, FcgiResponseHeaders &headers,
+           FcgiRecord *record) {
+    for (;;) {
+      int result = next(request_id, record);
+      if (result != 1 || record->type != kTypeStdout || headers.done())
+        return result;
+      if (headers.feed(&record->content, &record->content_length) < 0)
+        return -1;
+      if (record->content_length > 0) return 1;
+    }
+  }
+
+  // Indexes up to max buffered records with fcgiScanRecords and takes them
+  // out of the buffer. Content of out[i] starts at *base + out[i].offset and
+  // stays valid until the next fill(). Returns the number of descriptors,
+  // or -1 if the stream is corrupt and nothing could be indexed.
+  int scan(FcgiRecordDesc *out, size_t max, const Byte **base) {
+    size_t consumed;
+    bool corrupt;
+    *base = buf_.get() + begin_;
+    auto count = fcgiScanRecords(*base, buffered(), out, max, &consumed,
+                                 &corrupt);
+    begin_ += consumed;
+    for (size_t i = 0; i < count; ++i) {
+      size_t end = i + 1 < count ? out[i + 1].offset - sizeof(FcgiHeader)
+                                 : consumed;
+      manager_.traceReceived(out[i].type, out[i].request_id,
+                             end - (out[i].offset - sizeof(FcgiHeader)));
+    }
+    if (count == 0 && corrupt) {
+      errno = EPROTO;
+      return -1;
+    }
+    return static_cast<int>(count);
+  }
+
+  // Calls the visitor for every record already buffered, with spans that
+  // point straight into the receive buffer:
+  //   onStdout(int request_id, const Byte *data, size_t length)
+  //   onStderr(int request_id, const Byte *data, size_t length)
+  //   onEnd(int request_id, int app_status, int protocol_status)
+  // Any FcgiResponseHandler works. Returns the number of records visited,
+  // or -1 if the stream is corrupt.
+  template <typename Visitor>
+  int visit(Visitor &visitor) {
+    FcgiRecord record;
+    int visited = 0, res;
+    while ((res = parse(&record)) == 1) {
+      deliver(record, visitor);
+      ++visited;
+    }
+    return res < 0 ? -1 : visited;
+  }
+
+  // Blocks until the END_REQUEST of request_id. STDOUT content of that
+  // request goes from the connection to out_fd with splice() through a
+  // pipe, and only record headers and padding pass through userspace; all
+  // other records go to the visitor. Headers are read with exact-size
+  // recv() calls so that content is not pulled into the buffer. Returns
+  // the number of STDOUT bytes forwarded, or -1 on errors.
+  template <typename Visitor>
+  ssize_t spliceStdout(int request_id, int out_fd, Visitor &visitor) {
+    if (pipe_[0] < 0 && pipe2(pipe_, O_CLOEXEC) < 0) return -1;
+
+    ssize_t forwarded = 0;
+    for (;;) {
+      if (readExactly(sizeof(FcgiHeader)) < 0) return -1;
+
+      FcgiHeader header;
+      memcpy(&header, buf_.get() + begin_, sizeof(header));
+      if (header.version != kFcgiVersion) {
+        errno = EPROTO;
+        return -1;
+      }
+
+      size_t length = header.content_length(),
+             padding = header.padding_length;
+      if (header.type == kTypeStdout && header.request_id() == request_id) {
+        manager_.traceReceived(header.type, request_id,
+                               sizeof(header) + length + padding);
+        begin_ += sizeof(header);
+        if (forward(out_fd, length) < 0 || skip(padding) < 0) return -1;
+        forwarded += length;
+        continue;
+      }
+
+      FcgiRecord record;
+      if (readExactly(sizeof(header) + length + padding) < 0 ||
+          parse(&record) != 1)
+        return -1;
+      deliver(record, visitor);
+      if (record.type == kTypeEnd && record.request_id == request_id)
+        return forwarded;
+    }
+  }
+
+  // Appends bytes received by other means, e.g. from an io_uring buffer,
+  // as if fill() had read them. Returns false if they do not fit.
+  bool feed(const void *data, size_t length) {
+    if (begin_ == end_) begin_ = end_ = 0;
+    if (capacity_ - end_ < length) {
+      if (capacity_ - buffered() < length) return false;
+      memmove(buf_.get(), buf_.get() + begin_, buffered());
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    memcpy(buf_.get() + end_, data, length);
+    end_ += length;
+    return true;
+  }
+
+  size_t buffered() const { return end_ - begin_; }
+
+ private:
+  template <typename Visitor>
+  static void deliver(const FcgiRecord &record, Visitor &visitor) {
+    switch (record.type) {
+      case kTypeStdout:
+        visitor.onStdout(record.request_id, record.content,
+                         record.content_length);
+        break;
+      case kTypeStderr:
+        visitor.onStderr(record.request_id, record.content,
+                         record.content_length);
+        break;
+      case kTypeEnd:
+        visitor.onEnd(record.request_id, record.app_status(),
+                      record.protocol_status());
+        break;
+    }
+  }
+
+  // Receives until at least length bytes are buffered, asking the socket
+  // for no more than that.
+  int readExactly(size_t length) {
+    if (begin_ == end_) begin_ = end_ = 0;
+    if (capacity_ - begin_ < length) {
+      memmove(buf_.get(), buf_.get() + begin_, buffered());
+      end_ -= begin_;
+      begin_ = 0;
+    }
+
+    while (buffered() < length) {
+      auto received =
+          manager_.doRead(buf_.get() + end_, length - buffered());
+      if (received < 0 && errno == EINTR) continue;
+      if (received <= 0) return -1;
+      end_ += received;
+    }
+    return 0;
+  }
+
+  // Moves length content bytes to out_fd: whatever is already buffered
+  // with write(), the rest with splice().
+  int forward(int out_fd, size_t length) {
+    auto buffered_part = buffered() < length ? buffered() : length;
+    for (size_t done = 0; done < buffered_part;) {
+      auto written =
+          ::write(out_fd, buf_.get() + begin_ + done, buffered_part - done);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return -1;
+      done += written;
+    }
+    begin_ += buffered_part;
+    length -= buffered_part;
+
+    while (length > 0) {
+      auto moved = ::splice(manager_.fd(), nullptr, pipe_[1], nullptr,
+                            length, SPLICE_F_MOVE | SPLICE_F_MORE);
+      manager_.traceSyscall();
+      if (moved < 0 && errno == EINTR) continue;
+      if (moved <= 0) return -1;
+      length -= moved;
+
+      while (moved > 0) {
+        auto out = ::splice(pipe_[0], nullptr, out_fd, nullptr, moved,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (out < 0 && errno == EINTR) continue;
+        if (out <= 0) return -1;
+        moved -= out;
+      }
+    }
+    return 0;
+  }
+
+  // Drops padding, reading what is not buffered yet onto the stack.
+  int skip(size_t padding) {
+    auto buffered_part = buffered() < padding ? buffered() : padding;
+    begin_ += buffered_part;
+    padding -= buffered_part;
+
+    Byte scratch[0xff];
+    while (padding > 0) {
+      auto received = manager_.doRead(scratch, padding);
+      if (received < 0 && errno == EINTR) continue;
+      if (received <= 0) return -1;
+      padding -= received;
+    }
+    return 0;
+  }
+
+  const FcgiManager &manager_;
+  size_t capacity_;
+  std::unique_ptr<Byte[]> buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  int pipe_[2] = {-1, -1};
+};
+
+// Time budgets for one request, in milliseconds; 0 leaves a phase
+// unbounded. send runs from connected until the request is written and
+// first_byte from then until the first response bytes; total covers all
+// phases. abort_grace is how long END_REQUEST may take after a timeout
+// sent ABORT_REQUEST.
+struct FcgiDeadlines {
+  uint32_t connect = 0;
+  uint32_t send = 0;
+  uint32_t first_byte = 0;
+  uint32_t total = 0;
+  uint32_t abort_grace = 1000;
+};
+
+// Timer on an FcgiTimerWheel. It is linked into the wheel in place, so it
+// must not move while scheduled; destroying it cancels it.
+class FcgiTimer {
+ public:
+  typedef void (*Callback)(FcgiTimer &timer, void *context);
+
+  FcgiTimer() {}
+  FcgiTimer(Callback callback, void *context)
+      : callback_(callback), context_(context) {}
+  FcgiTimer(const FcgiTimer &) = delete;
+  FcgiTimer &operator=(const FcgiTimer &) = delete;
+
+  ~FcgiTimer() { cancel(); }
+
+  void set_callback(Callback callback, void *context) {
+    callback_ = callback;
+    context_ = context;
+  }
+
+  bool scheduled() const { return link_.next != nullptr; }
+  uint64_t expires() const { return expires_; }
+
+  // O(1): the timer only unlinks itself from its slot.
+  void cancel() {
+    if (!scheduled()) return;
+    link_.prev->next = link_.next;
+    link_.next->prev = link_.prev;
+    link_.prev = link_.next = nullptr;
+  }
+
+ private:
+  friend class FcgiTimerWheel;
+
+  struct Link {
+    Link *prev = nullptr;
+    Link *next = nullptr;
+  };
+
+  Link link_;
+  uint64_t expires_ = 0;
+  Callback callback_ = nullptr;
+  void *context_ = nullptr;
+};
+
+// Hierarchical timer wheel with millisecond ticks: four levels of 64 slots
+// cover about 4.6 hours, and later timers wait in the last level. Schedule
+// and cancel are O(1) list operations; advance() visits only occupied
+// slots, found through one bitmap word per level. There is no lock: each
+// event loop thread owns its wheel, and timers may only be touched from
+// that thread.
+class FcgiTimerWheel {
+ public:
+  explicit FcgiTimerWheel(uint64_t now = now_ms()) : now_(now) {
+    for (auto &level : slots_)
+      for (auto &slot : level) slot.prev = slot.next = &slot;
+  }
+
+  FcgiTimerWheel(const FcgiTimerWheel &) = delete;
+  FcgiTimerWheel &operator=(const FcgiTimerWheel &) = delete;
+
+  // Unlinks what is still scheduled, so that the timers outlive the wheel
+  // safely.
+  ~FcgiTimerWheel() {
+    for (auto &level : slots_)
+      for (auto &slot : level)
+        while (slot.next != &slot) timerOf(slot.next)->cancel();
+  }
+
+  static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Where the wheel stands, as of the last advance().
+  uint64_t now() const { return now_; }
+
+  // (Re)arms timer to fire delay ticks from now(), and no sooner than the
+  // next tick.
+  void schedule(FcgiTimer &timer, uint64_t delay) {
+    timer.cancel();
+    timer.expires_ = now_ + (delay > 0 ? delay : 1);
+    insert(timer);
+  }
+
+  // Moves the wheel to now and runs the callbacks of the timers that came
+  // due, which may schedule and cancel timers themselves. Returns how many
+  // fired.
+  size_t advance(uint64_t now = now_ms()) {
+    size_t fired = 0;
+    while (now_ < now) {
+      auto next = nextTick();
+      if (next > now) {
+        now_ = now;
+        break;
+      }
+
+      now_ = next;
+      for (int level = 1; level < kLevels; ++level) {
+        if ((now_ & ((uint64_t(1) << (kSlotBits * level)) - 1)) != 0) break;
+        cascade(level);
+      }
+      fired += expire();
+    }
+    return fired;
+  }
+
+  // Milliseconds from now until advance() may have work, for epoll_wait():
+  // -1 without timers. Timers beyond the first level wake the loop when
+  // they are due to move down a level.
+  int timeout(uint64_t now = now_ms()) const {
+    bool any = false;
+    for (auto occupied : occupied_) any = any || occupied != 0;
+    if (!any) return -1;
+
+    auto next = nextTick();
+    return next > now ? static_cast<int>(next - now) : 0;
+  }
+
+ private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr int kSlots = 1 << kSlotBits;
+
+  typedef FcgiTimer::Link Link;
+
+  static FcgiTimer *timerOf(Link *link) {
+    return reinterpret_cast<FcgiTimer *>(reinterpret_cast<char *>(link) -
+                                         offsetof(FcgiTimer, link_));
+  }
+
+  static size_t slotOf(uint64_t time, int level) {
+    return (time >> (kSlotBits * level)) & (kSlots - 1);
+  }
+
+  void insert(FcgiTimer &timer) {
+    auto expires = timer.expires_ > now_ ? timer.expires_ : now_;
+    auto delta = expires - now_;
+    int level = 0;
+    while (level < kLevels - 1 &&
+           delta >= uint64_t(1) << (kSlotBits * (level + 1)))
+      ++level;
+    if (delta >> (kSlotBits * kLevels) != 0)
+      expires = now_ + (uint64_t(1) << (kSlotBits * kLevels)) - 1;
+
+    auto slot = slotOf(expires, level);
+    Link &head = slots_[level][slot];
+    timer.link_.prev = head.prev;
+    timer.link_.next = &head;
+    head.prev->next = &timer.link_;
+    head.prev = &timer.link_;
+    occupied_[level] |= uint64_t(1) << slot;
+  }
+
+  // The next tick with an occupied first-level slot, or the start of the
+  // next round of the first level, whichever comes first. Cancelled timers
+  // leave their bit behind until the slot is visited.
+  uint64_t nextTick() const {
+    auto slot = slotOf(now_, 0);
+    auto later = slot + 1 < kSlots ? occupied_[0] >> (slot + 1) << (slot + 1)
+                                   : 0;
+    auto round = now_ & ~uint64_t(kSlots - 1);
+    if (later != 0) return round + __builtin_ctzll(later);
+    return round + kSlots;
+  }
+
+  // Takes the slot's list out of the wheel, so callbacks can touch the
+  // wheel while it is walked.
+  void detach(int level, size_t slot, Link *list) {
+    Link &head = slots_[level][slot];
+    occupied_[level] &= ~(uint64_t(1) << slot);
+    if (head.next == &head) {
+      list->prev = list->next = list;
+      return;
+    }
+    list->next = head.next;
+    list->prev = head.prev;
+    list->next->prev = list->prev->next = list;
+    head.prev = head.next = &head;
+  }
+
+  void cascade(int level) {
+    Link list;
+    detach(level, slotOf(now_, level), &list);
+    while (list.next != &list) {
+      auto timer = timerOf(list.next);
+      timer->cancel();
+      insert(*timer);
+    }
+  }
+
+  size_t expire() {
+    Link list;
+    size_t fired = 0;
+    detach(0, slotOf(now_, 0), &list);
+    while (list.next != &list) {
+      auto timer = timerOf(list.next);
+      timer->cancel();
+      if (timer->expires_ > now_) {
+        insert(*timer);
+        continue;
+      }
+      ++fired;
+      if (timer->callback_ != nullptr)
+        timer->callback_(*timer, timer->context_);
+    }
+    return fired;
+  }
+
+  uint64_t now_;
+  Link slots_[kLevels][kSlots];
+  uint64_t occupied_[kLevels] = {};
+};
+
+// A single request driven by readiness events from an external event loop.
+// Register fd() for events() with epoll (the values are EPOLLIN/EPOLLOUT),
+// pass whatever fired to onEvent(), and drain records with nextRecord()
+// after every readable event. The manager must use non-blocking mode.
+// With setDeadlines(), timers on the loop's FcgiTimerWheel bound each
+// phase; a timeout may change state() and events() from within advance().
+// Completion-based transports use output(), onSent() and onReceived()
+// instead of onEvent(); FcgiAsyncLoop runs requests over either.
+class FcgiAsyncRequest {
+ public:
+  enum State { kConnecting, kWriting, kReading, kDone, kFailed };
+
+  // With an arena, the encode buffers live there until the caller resets
+  // it after the request is done.
+  FcgiAsyncRequest(FcgiManager &manager, int request_id = 1,
+                   FcgiRole role = kRoleResponder, bool keep_alive = false,
+                   FcgiRequestArena *arena = nullptr)
+      : manager_(manager),
+        reader_(manager),
+        params_(request_id, arena),
+        out_(arena),
+        request_id_(request_id),
+        role_(role),
+        keep_alive_(keep_alive),
+        state_(manager.connecting() ? kConnecting : kWriting) {
+    assert(manager.nonblocking());
+  }
+
+  // Params to send; fill before the first event is handled.
+  FcgiParamsBuilder &params() { return params_; }
+
+  // Small request body sent as one STDIN stream along with the params.
+  void setStdin(const void *data, size_t length) {
+    stdin_ = static_cast<const Byte *>(data);
+    stdin_length_ = length;
+  }
+
+  // Starts the clock on deadlines, with the phase timer on wheel, which
+  // must outlive the request. A phase that runs out before anything was
+  // sent fails the request with ETIMEDOUT at once. Later ones take the
+  // abort() path, so that a keep-alive connection survives if END_REQUEST
+  // arrives within abort_grace; otherwise the request fails with ETIMEDOUT
+  // and the connection must be closed.
+  void setDeadlines(const FcgiDeadlines &deadlines, FcgiTimerWheel &wheel) {
+    deadlines_ = deadlines;
+    wheel_ = &wheel;
+    started_ = wheel.now();
+    phase_ = kNoPhase;
+    timer_.set_callback(onTimeout, this);
+    updateTimer();
+  }
+
+  // True once a deadline passed, even if END_REQUEST still came in time.
+  bool timed_out() const { return timed_out_; }
+
+  int fd() const { return manager_.fd(); }
+  int request_id() const { return request_id_; }
+  State state() const { return state_; }
+  int error() const { return error_; }
+
+  uint32_t events() const {
+    switch (state_) {
+      case kConnecting:
+      case kWriting:
+        return EPOLLOUT;
+      case kReading:
+        return EPOLLIN;
+      default:
+        return 0;
+    }
+  }
+
+  State onEvent(uint32_t events) {
+    if (state_ == kConnecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      if (manager_.finishConnect() < 0) return fail(errno);
+      state_ = kWriting;
+    }
+
+    if (state_ == kWriting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      if (out_.empty()) encode();
+      if (flush() < 0) return fail(errno);
+    }
+
+    if (state_ == kReading && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+      auto received = reader_.fill();
+      if (received == 0) return fail(ECONNRESET);
+      if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != ENOBUFS)
+        return fail(errno);
+      if (received > 0) first_byte_ = true;
+    }
+    updateTimer();
+    return state_;
+  }
+
+  // Once connected, the encoded bytes still to send; false while there are
+  // none. They stay in place until onSent(), even if abort() appends to
+  // them in between.
+  bool output(const Byte **data, size_t *length) {
+    if (state_ != kWriting) return false;
+    if (out_.empty()) encode();
+    *data = out_.data() + written_;
+    *length = out_.size() - written_;
+    return *length > 0;
+  }
+
+  // Takes the outcome of sending output(): bytes sent, or -errno.
+  State onSent(ssize_t result) {
+    if (state_ == kDone || state_ == kFailed) return state_;
+    if (result < 0) return fail(static_cast<int>(-result));
+    written_ += result;
+    if (written_ == out_.size()) wrote();
+    updateTimer();
+    return state_;
+  }
+
+  // Takes bytes received by the transport, 0 at end of stream or -errno,
+  // for nextRecord() to hand out.
+  State onReceived(const void *data, ssize_t result) {
+    if (state_ == kDone || state_ == kFailed) return state_;
+    if (result == 0) return fail(ECONNRESET);
+    if (result < 0) return fail(static_cast<int>(-result));
+    if (!reader_.feed(data, result)) return fail(ENOBUFS);
+    first_byte_ = true;
+    updateTimer();
+    return state_;
+  }
+
+  // Fails the request, e.g. because the transport could not take it.
+  State onError(int error) {
+    if (state_ == kDone || state_ == kFailed) return state_;
+    return fail(error);
+  }
+
+  // Gives up on the request, e.g. because the client went away, without
+  // spoiling a keep-alive connection. Before anything was sent this ends
+  // the request at once; otherwise ABORT_REQUEST is queued behind the
+  // records already encoded, and STDOUT/STDERR are dropped from then on
+  // until END_REQUEST moves the request to kDone.
+  void abort() {
+    if (aborted_ || state_ == kDone || state_ == kFailed) return;
+    aborted_ = true;
+    if (state_ == kConnecting || out_.empty()) {
+      state_ = kDone;
+      return;
+    }
+
+    FcgiHeader header(kTypeAbort, 0, request_id_);
+    out_.append(&header, sizeof(header));
+    manager_.traceSent(kTypeAbort, 1, sizeof(header));
+    state_ = kWriting;
+    updateTimer();
+  }
+
+  bool aborted() const { return aborted_; }
+
+  // Hands out the next buffered record of this request. Returns 1 on a
+  // record and 0 if more input is needed; the END_REQUEST record moves the
+  // request to kDone. After abort() only END_REQUEST is handed out.
+  int nextRecord(FcgiRecord *record) {
+    while (state_ == kReading) {
+      int parsed = reader_.parse(record);
+      if (parsed < 0) {
+        fail(errno);
+        return 0;
+      }
+      if (parsed == 0) return 0;
+      if (record->request_id != request_id_) continue;
+      if (aborted_ && record->type != kTypeEnd) continue;
+
+      if (record->type == kTypeEnd) {
+        state_ = kDone;
+        updateTimer();
+      }
+      return 1;
+    }
+    return 0;
+  }
+
+ private:
+  void encode() {
+    FcgiRequestBegin begin{
+        {kTypeBegin, sizeof(FcgiRequestBeginBody), request_id_},
+        {role_, keep_alive_}};
+    params_.finish();
+    manager_.traceBegin(request_id_);
+    manager_.traceSent(kTypeBegin, 1, sizeof(begin));
+    manager_.traceSent(kTypeParams, params_.records(), params_.size());
+
+    // With room for the ABORT_REQUEST of abort(), so that it never moves
+    // the buffer under a send in flight.
+    out_.reserve(sizeof(begin) + params_.size() + stdin_length_ +
+                 (stdin_length_ / kFcgiMaxContentLength + 3) *
+                     (sizeof(FcgiHeader) + sizeof(kFcgiPadding)));
+    out_.append(&begin, sizeof(begin));
+    params_.forEachSegment(
+        [this](const Byte *data, size_t length) { out_.append(data, length); });
+
+    for (size_t offset = 0; offset < stdin_length_;) {
+      size_t chunk = stdin_length_ - offset;
+      if (chunk > kFcgiMaxContentLength) chunk = kFcgiMaxContentLength;
+
+      int padding = FcgiManager::paddingFor(chunk);
+      FcgiHeader header(kTypeStdin, chunk, request_id_, padding);
+      out_.append(&header, sizeof(header));
+      out_.append(stdin_ + offset, chunk);
+      out_.append(kFcgiPadding, padding);
+      offset += chunk;
+      manager_.traceSent(kTypeStdin, 1, sizeof(header) + chunk + padding);
+    }
+    FcgiHeader end(kTypeStdin, 0, request_id_);
+    out_.append(&end, sizeof(end));
+    manager_.traceSent(kTypeStdin, 1, sizeof(end));
+  }
+
+  int flush() {
+    while (written_ < out_.size()) {
+      int sent =
+          manager_.doWrite(out_.data() + written_, out_.size() - written_);
+      if (sent < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      }
+      written_ += sent;
+    }
+    wrote();
+    return 0;
+  }
+
+  void wrote() {
+    if (!aborted_) {
+      manager_.traceParamsFlushed();
+      manager_.traceStdinFlushed();
+    }
+    state_ = kReading;
+  }
+
+  State fail(int error) {
+    error_ = error;
+    state_ = kFailed;
+    timer_.cancel();
+    return state_;
+  }
+
+  enum Phase {
+    kNoPhase,
+    kConnectPhase,
+    kSendPhase,
+    kFirstBytePhase,
+    kBodyPhase,
+    kAbortPhase,
+    kEndPhase
+  };
+
+  Phase phase() const {
+    if (state_ == kDone || state_ == kFailed) return kEndPhase;
+    if (aborted_) return kAbortPhase;
+    if (state_ == kConnecting) return kConnectPhase;
+    if (state_ == kWriting) return kSendPhase;
+    return first_byte_ ? kBodyPhase : kFirstBytePhase;
+  }
+
+  // Rearms the timer when the request entered another phase: to the
+  // phase's budget, cut short by what is left of the total one.
+  void updateTimer() {
+    auto phase = this->phase();
+    if (wheel_ == nullptr || phase == phase_) return;
+    phase_ = phase;
+
+    uint64_t budget = 0, now = wheel_->now();
+    switch (phase) {
+      case kConnectPhase:
+        budget = deadlines_.connect;
+        break;
+      case kSendPhase:
+        budget = deadlines_.send;
+        break;
+      case kFirstBytePhase:
+        budget = deadlines_.first_byte;
+        break;
+      case kAbortPhase:
+        wheel_->schedule(timer_, deadlines_.abort_grace);
+        return;
+      default:
+        break;
+    }
+
+    if (deadlines_.total > 0) {
+      auto end = started_ + deadlines_.total;
+      auto left = end > now ? end - now : 0;
+      if (budget == 0 || left < budget) budget = left > 0 ? left : 1;
+    }
+    if (phase == kEndPhase || budget == 0)
+      timer_.cancel();
+    else
+      wheel_->schedule(timer_, budget);
+  }
+
+  static void onTimeout(FcgiTimer &, void *context) {
+    auto request = static_cast<FcgiAsyncRequest *>(context);
+    request->timed_out_ = true;
+    request->error_ = ETIMEDOUT;
+    if (request->aborted_ || request->state_ == kConnecting ||
+        request->out_.empty()) {
+      request->fail(ETIMEDOUT);
+      return;
+    }
+    request->abort();
+  }
+
+  FcgiManager &manager_;
+  FcgiResponseReader reader_;
+  FcgiParamsBuilder params_;
+  FcgiBuffer out_;
+  size_t written_ = 0;
+  const Byte *stdin_ = nullptr;
+  size_t stdin_length_ = 0;
+  int request_id_;
+  FcgiRole role_;
+  bool keep_alive_;
+  State state_;
+  int error_ = 0;
+  bool aborted_ = false;
+  bool first_byte_ = false;
+  bool timed_out_ = false;
+  FcgiDeadlines deadlines_;
+  FcgiTimerWheel *wheel_ = nullptr;
+  FcgiTimer timer_;
+  uint64_t started_ = 0;
+  Phase phase_ = kNoPhase;
+};
+
+#ifdef PFASTCGI_USE_IO_URING
+// Optional io_uring transport in place of doRead/doWrite on non-blocking
+// connections. Sends are queued and go to the kernel together with one
+// io_uring_enter in submit(); receives use multishot recv into a registered
+// buffer ring. ok() is false when the kernel lacks io_uring or buffer rings
+// (before 5.19), and a multishot recv completes with -EINVAL before 6.0;
+// FcgiAsyncLoop falls back to epoll on its own in both cases.
+class FcgiUring {
+ public:
+  struct Completion {
+    uint64_t user_data;
+    int result;        // bytes transferred, or -errno
+    const Byte *data;  // received bytes, valid during the callback only
+    bool more;         // the multishot recv stays armed
+  };
+
+  explicit FcgiUring(unsigned entries = 256, unsigned buffers = 256,
+                     unsigned buffer_size = 16 * 1024, int buffer_group = 0)
+      : buffer_size_(buffer_size), buffer_group_(buffer_group) {
+    assert((buffers & (buffers - 1)) == 0 && buffers <= 0x8000);
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Keeps submitting past an entry that fails early, such as a refused
+    // multishot recv. Kernels with buffer rings (5.19) all have it (5.18).
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0) return;
+    if (!mapRings(params) || !registerBuffers(buffers)) {
+      destroy();
+      return;
+    }
+  }
+
+  FcgiUring(const FcgiUring &) = delete;
+  FcgiUring &operator=(const FcgiUring &) = delete;
+
+  ~FcgiUring() { destroy(); }
+
+  bool ok() const { return ring_fd_ >= 0; }
+
+  // Queues a send of the whole buffer, which must stay alive until its
+  // completion. MSG_WAITALL makes the kernel retry short sends itself.
+  bool send(int fd, const void *buf, size_t length, uint64_t user_data) {
+    auto sqe = nextSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = length;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+  }
+
+  // Arms one recv that keeps producing completions, each carrying a buffer
+  // from the ring, until the connection closes or the ring runs dry
+  // (-ENOBUFS, re-arm after the next reap()).
+  bool recvMultishot(int fd, uint64_t user_data) {
+    auto sqe = nextSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group_;
+    sqe->user_data = user_data;
+    return true;
+  }
+
+  // Queues a one-shot poll, which completes with the poll(2) events that
+  // fired; they have the same values as the EPOLL ones.
+  bool poll(int fd, uint32_t events, uint64_t user_data) {
+    auto sqe = nextSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    return true;
+  }
+
+  // Queues the cancellation of the operation queued with target. The
+  // cancellation completes on its own, with user_data.
+  bool cancel(uint64_t target, uint64_t user_data) {
+    auto sqe = nextSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    return true;
+  }
+
+  // Hands everything queued to the kernel in one io_uring_enter and
+  // optionally waits for wait_for completions, for at most timeout_ms
+  // unless that is negative. The wait running out is not an error.
+  int submit(unsigned wait_for = 0, int timeout_ms = -1) {
+    // Counted from the kernel's head, which only moves in here, so that
+    // whatever an earlier call left unsubmitted goes along.
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    auto pending = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    __kernel_timespec timeout = {timeout_ms / 1000,
+                                 timeout_ms % 1000 * 1000000LL};
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    bool timed = wait_for > 0 && timeout_ms >= 0;
+
+    int res;
+    do {
+      res = syscall(__NR_io_uring_enter, ring_fd_, pending, wait_for,
+                    (wait_for > 0 ? IORING_ENTER_GETEVENTS : 0) |
+                        (timed ? IORING_ENTER_EXT_ARG : 0),
+                    timed ? &arg : nullptr, timed ? sizeof(arg) : 0);
+    } while (res < 0 && errno == EINTR);
+    return res < 0 && errno == ETIME ? 0 : res;
+  }
+
+  // Calls fn(const Completion &) for every completion available, then
+  // returns the consumed receive buffers to the ring.
+  template <typename Fn>
+  unsigned reap(Fn &&fn) {
+    unsigned head = *cq_head_,
+             tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE), count = 0,
+             recycled = 0;
+
+    for (; head != tail; ++head, ++count) {
+      const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+      Completion completion{cqe.user_data, cqe.res, nullptr,
+                            (cqe.flags & IORING_CQE_F_MORE) != 0};
+
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        completion.data = buffers_ + static_cast<size_t>(bid) * buffer_size_;
+        fn(completion);
+        recycle(bid, recycled++);
+      } else {
+        fn(completion);
+      }
+    }
+
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (recycled > 0) publishBuffers(recycled);
+    return count;
+  }
+
+ private:
+  bool mapRings(const io_uring_params &params) {
+    sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      if (cq_map_size_ > sq_map_size_) sq_map_size_ = cq_map_size_;
+      cq_map_size_ = 0;
+    }
+
+    sq_map_ = map(sq_map_size_, IORING_OFF_SQ_RING);
+    if (sq_map_ == nullptr) return false;
+    cq_map_ = cq_map_size_ ? map(cq_map_size_, IORING_OFF_CQ_RING) : sq_map_;
+    if (cq_map_ == nullptr) return false;
+    sqes_map_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map(sqes_map_size_, IORING_OFF_SQES));
+    if (sqes_ == nullptr) return false;
+
+    auto sq = static_cast<Byte *>(sq_map_), cq = static_cast<Byte *>(cq_map_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+
+    auto array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) array[i] = i;
+
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void *map(size_t length, off_t offset) {
+    void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  bool registerBuffers(unsigned buffers) {
+    buf_ring_size_ = buffers * sizeof(io_uring_buf);
+    buffers_size_ = static_cast<size_t>(buffers) * buffer_size_;
+    void *ring = mmap(nullptr, buf_ring_size_ + buffers_size_,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (ring == MAP_FAILED) return false;
+    buf_ring_ = static_cast<io_uring_buf *>(ring);
+    buffers_ = static_cast<Byte *>(ring) + buf_ring_size_;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = buffers;
+    reg.bgid = buffer_group_;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+      return false;
+
+    buf_mask_ = buffers - 1;
+    for (unsigned bid = 0; bid < buffers; ++bid) recycle(bid, bid);
+    publishBuffers(buffers);
+    return true;
+  }
+
+  // The ring tail shares its slot with the reserved field of bufs[0].
+  uint16_t *bufRingTail() {
+    return reinterpret_cast<uint16_t *>(&buf_ring_[0].resv);
+  }
+
+  void recycle(unsigned bid, unsigned offset) {
+    auto &buf = buf_ring_[(buf_tail_ + offset) & buf_mask_];
+    buf.addr = reinterpret_cast<uint64_t>(buffers_) +
+               static_cast<uint64_t>(bid) * buffer_size_;
+    buf.len = buffer_size_;
+    buf.bid = bid;
+  }
+
+  void publishBuffers(unsigned count) {
+    buf_tail_ += count;
+    __atomic_store_n(bufRingTail(), buf_tail_, __ATOMIC_RELEASE);
+  }
+
+  io_uring_sqe *nextSqe() {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+        sq_entries_)
+      return nullptr;
+    auto sqe = &sqes_[sq_local_tail_++ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  void destroy() {
+    if (sqes_ != nullptr) munmap(sqes_, sqes_map_size_);
+    if (cq_map_ != nullptr && cq_map_ != sq_map_) munmap(cq_map_, cq_map_size_);
+    if (sq_map_ != nullptr) munmap(sq_map_, sq_map_size_);
+    if (buf_ring_ != nullptr) munmap(buf_ring_, buf_ring_size_ + buffers_size_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+    sqes_ = nullptr;
+    sq_map_ = cq_map_ = nullptr;
+    buf_ring_ = nullptr;
+    ring_fd_ = -1;
+  }
+
+  int ring_fd_ = -1;
+  unsigned buffer_size_;
+  int buffer_group_;
+
+  void *sq_map_ = nullptr;
+  void *cq_map_ = nullptr;
+  size_t sq_map_size_ = 0;
+  size_t cq_map_size_ = 0;
+  size_t sqes_map_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_local_tail_ = 0;
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned *cq_mask_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+
+  io_uring_buf *buf_ring_ = nullptr;
+  Byte *buffers_ = nullptr;
+  size_t buf_ring_size_ = 0;
+  size_t buffers_size_ = 0;
+  unsigned buf_mask_ = 0;
+  uint16_t buf_tail_ = 0;
+};
+#endif  // PFASTCGI_USE_IO_URING
+
+// Runs FcgiAsyncRequests to the end on one thread. With
+// PFASTCGI_USE_IO_URING they go over FcgiUring when the kernel has it, and
+// over epoll otherwise; a request whose multishot recv the kernel refuses
+// (before 6.0) moves to epoll, and so do all later ones. Deadlines set
+// with timers() are kept on either transport.
+//
+//   FcgiAsyncLoop loop;
+//   FcgiAsyncRequest request(*manager);
+//   request.params().add("SCRIPT_FILENAME", "/srv/www/index.php");
+//   loop.add(request);
+//   loop.run([](FcgiAsyncRequest &request, const FcgiRecord *record) {
+//     if (record == nullptr) ...  // finished, in request.state()
+//   });
+class FcgiAsyncLoop {
+ public:
+  explicit FcgiAsyncLoop(bool use_uring = true)
+      : epfd_(epoll_create1(EPOLL_CLOEXEC)) {
+#ifdef PFASTCGI_USE_IO_URING
+    if (use_uring) ring_.reset(new FcgiUring());
+    if (ring_ != nullptr && !ring_->ok()) ring_.reset();
+#else
+    (void)use_uring;
+#endif
+  }
+
+  FcgiAsyncLoop(const FcgiAsyncLoop &) = delete;
+  FcgiAsyncLoop &operator=(const FcgiAsyncLoop &) = delete;
+
+  ~FcgiAsyncLoop() {
+    if (epfd_ >= 0) close(epfd_);
+  }
+
+  bool ok() const { return epfd_ >= 0; }
+
+  // True while new requests go over io_uring.
+  bool uring() const {
+#ifdef PFASTCGI_USE_IO_URING
+    return ring_ != nullptr && multishot_;
+#else
+    return false;
+#endif
+  }
+
+  // For FcgiAsyncRequest::setDeadlines(); run() advances it.
+  FcgiTimerWheel &timers() { return timers_; }
+
+  // Starts driving request, which must stay alive until run() hands it
+  // back. Returns 0, or -1 with errno set if it cannot be driven.
+  int add(FcgiAsyncRequest &request) {
+    std::unique_ptr<Slot> slot(new Slot());
+    slot->request = &request;
+    slot->index = slots_.size();
+#ifdef PFASTCGI_USE_IO_URING
+    slot->uring = uring();
+#endif
+    auto &added = *slot;
+    slots_.push_back(std::move(slot));
+    if (busy(added)) return 0;
+
+    remove(added);
+    errno = request.error() != 0 ? request.error() : EINVAL;
+    return -1;
+  }
+
+  // Handles I/O until every request added has finished, firing due timers
+  // in between. fn(FcgiAsyncRequest &, const FcgiRecord *) gets each
+  // record of a request as nextRecord() hands it out, and nullptr once the
+  // loop let go of the request in kDone or kFailed; it may add requests.
+  // Returns 0, or -1 if waiting for I/O failed.
+  template <typename Fn>
+  int run(Fn &&fn) {
+    while (!slots_.empty()) {
+      if (wait(timers_.timeout(), fn) < 0) return -1;
+
+      // A timeout may have failed or aborted requests.
+      if (timers_.advance() > 0)
+        for (auto i = slots_.size(); i-- > 0;) update(*slots_[i], fn);
+    }
+    return 0;
+  }
+
+ private:
+  struct Slot {
+    FcgiAsyncRequest *request = nullptr;
+    size_t index = 0;
+    uint32_t events = 0;
+    bool watched = false;
+    bool uring = false;
+    bool polling = false;
+    bool sending = false;
+    bool receiving = false;
+    bool cancelled = false;
+  };
+
+  template <typename Fn>
+  static void drain(FcgiAsyncRequest &request, Fn &fn) {
+    FcgiRecord record;
+    while (request.nextRecord(&record) == 1) fn(request, &record);
+  }
+
+  // Moves the request on after an event; hands it back once it is over.
+  template <typename Fn>
+  void update(Slot &slot, Fn &fn) {
+    if (busy(slot)) return;
+    auto &request = *slot.request;
+    remove(slot);
+    fn(request, nullptr);
+  }
+
+  // Starts what the request waits for. False once it waits for nothing.
+  bool busy(Slot &slot) {
+#ifdef PFASTCGI_USE_IO_URING
+    if (slot.uring) return drive(slot);
+    if (slot.polling || slot.sending || slot.receiving) return true;
+#endif
+    return watch(slot);
+  }
+
+  // Brings the epoll registration in line with events().
+  bool watch(Slot &slot) {
+    auto &request = *slot.request;
+    auto events = request.events();
+    if (events != 0 && events != slot.events) {
+      epoll_event event;
+      event.events = events;
+      event.data.ptr = &slot;
+      if (epoll_ctl(epfd_, slot.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                    request.fd(), &event) == 0) {
+        slot.events = events;
+        if (!slot.watched) ++watched_;
+        slot.watched = true;
+      } else {
+        request.onError(errno);
+        events = 0;
+      }
+    }
+
+    if (events == 0) {
+      if (slot.watched) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, request.fd(), nullptr);
+        --watched_;
+      }
+      slot.watched = false;
+      slot.events = 0;
+      return false;
+    }
+#ifdef PFASTCGI_USE_IO_URING
+    armEpoll();
+#endif
+    return true;
+  }
+
+  template <typename Fn>
+  int wait(int timeout, Fn &fn) {
+#ifdef PFASTCGI_USE_IO_URING
+    if (ring_ != nullptr) {
+      if (ring_->submit(1, timeout) < 0) return -1;
+      ring_->reap([&](const FcgiUring::Completion &completion) {
+        complete(completion, fn);
+      });
+      return 0;
+    }
+#endif
+    return waitEpoll(timeout, fn);
+  }
+
+  template <typename Fn>
+  int waitEpoll(int timeout, Fn &fn) {
+    epoll_event events[64];
+    int count = epoll_wait(epfd_, events, 64, timeout);
+    if (count < 0) return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < count; ++i) {
+      auto &slot = *static_cast<Slot *>(events[i].data.ptr);
+      slot.request->onEvent(events[i].events);
+      drain(*slot.request, fn);
+      update(slot, fn);
+    }
+    return count;
+  }
+
+  void remove(Slot &slot) {
+    std::unique_ptr<Slot> removed = std::move(slots_[slot.index]);
+    if (removed->index + 1 < slots_.size()) {
+      slots_[removed->index] = std::move(slots_.back());
+      slots_[removed->index]->index = removed->index;
+    }
+    slots_.pop_back();
+  }
+
+#ifdef PFASTCGI_USE_IO_URING
+  // user_data is the Slot with the operation in the low bits; 0 marks
+  // cancellations, whose completions are of no interest.
+  static constexpr uint64_t kOpMask = 7;
+  static constexpr uint64_t kPollOp = 1;
+  static constexpr uint64_t kSendOp = 2;
+  static constexpr uint64_t kRecvOp = 3;
+  static constexpr uint64_t kEpollTag = 4;
+
+  // Queues an operation, handing the queue to the kernel first if full.
+  template <typename Op>
+  bool queue(Op op) {
+    if (op()) return true;
+    ring_->submit();
+    return op();
+  }
+
+  // Requests that fell back to epoll are watched through a poll of the
+  // epoll fd on the ring, so that one wait covers both.
+  void armEpoll() {
+    if (ring_ == nullptr || epoll_armed_ || watched_ == 0) return;
+    epoll_armed_ =
+        queue([&] { return ring_->poll(epfd_, EPOLLIN, kEpollTag); });
+  }
+
+  // Queues the operations the request is waiting for, or cancels the
+  // outstanding ones once it is over. True while any are outstanding.
+  bool drive(Slot &slot) {
+    auto &request = *slot.request;
+    auto fd = request.fd();
+    auto tag = reinterpret_cast<uint64_t>(&slot);
+    auto state = request.state();
+
+    if (state == FcgiAsyncRequest::kConnecting && !slot.polling) {
+      slot.polling =
+          queue([&] { return ring_->poll(fd, EPOLLOUT, tag | kPollOp); });
+      if (!slot.polling) request.onError(EAGAIN);
+    }
+
+    const Byte *data;
+    size_t length;
+    if (!slot.sending && request.output(&data, &length)) {
+      slot.sending = queue(
+          [&] { return ring_->send(fd, data, length, tag | kSendOp); });
+      if (!slot.sending) request.onError(EAGAIN);
+    }
+
+    if (request.state() == FcgiAsyncRequest::kReading && !slot.receiving) {
+      slot.receiving =
+          queue([&] { return ring_->recvMultishot(fd, tag | kRecvOp); });
+      if (!slot.receiving) request.onError(EAGAIN);
+    }
+
+    bool outstanding = slot.polling || slot.sending || slot.receiving;
+    state = request.state();
+    if (state != FcgiAsyncRequest::kDone &&
+        state != FcgiAsyncRequest::kFailed)
+      return outstanding;
+
+    if (outstanding && !slot.cancelled) {
+      slot.cancelled = true;
+      if (slot.polling) queue([&] { return ring_->cancel(tag | kPollOp, 0); });
+      if (slot.sending) queue([&] { return ring_->cancel(tag | kSendOp, 0); });
+      if (slot.receiving)
+        queue([&] { return ring_->cancel(tag | kRecvOp, 0); });
+    }
+    return outstanding;
+  }
+
+  template <typename Fn>
+  void complete(const FcgiUring::Completion &completion, Fn &fn) {
+    if (completion.user_data == 0) return;
+    if (completion.user_data == kEpollTag) {
+      epoll_armed_ = false;
+      waitEpoll(0, fn);
+      armEpoll();
+      return;
+    }
+
+    auto &slot = *reinterpret_cast<Slot *>(completion.user_data & ~kOpMask);
+    auto &request = *slot.request;
+    auto result = completion.result;
+    switch (completion.user_data & kOpMask) {
+      case kPollOp:
+        slot.polling = false;
+        if (result < 0)
+          request.onError(-result);
+        else
+          request.onEvent(result);
+        break;
+      case kSendOp:
+        slot.sending = false;
+        request.onSent(result);
+        break;
+      case kRecvOp:
+        if (!completion.more) slot.receiving = false;
+        if (result == -EINVAL && !completion.more) {
+          multishot_ = false;
+          slot.uring = false;
+        } else if (result != -ENOBUFS) {
+          request.onReceived(completion.data, result);
+          drain(request, fn);
+        }
+        break;
+    }
+    update(slot, fn);
+  }
+
+  std::unique_ptr<FcgiUring> ring_;
+  bool multishot_ = true;
+  bool epoll_armed_ = false;
+#endif
+
+  int epfd_;
+  size_t watched_ = 0;
+  std::vector<std::unique_ptr<Slot>> slots_;
+  FcgiTimerWheel timers_;
+};
+
+// Hands out request ids from a bitmap over 1..limit, lowest free id first.
+class FcgiRequestIdAllocator {
+ public:
+  explicit FcgiRequestIdAllocator(int limit = kFcgiMaxRequestId)
+      : limit_(limit), words_((limit >> 6) + 1, 0) {
+    assert(limit > 0 && limit <= kFcgiMaxRequestId);
+    words_[0] = 1;  // id 0 is reserved for management records
+  }
+
+  // Returns a free id, or -1 when all of 1..limit are in use.
+  int allocate() {
+    if (used_ == limit_) return -1;
+    for (size_t i = hint_, n = words_.size(); i < n + hint_; ++i) {
+      auto &word = words_[i % n];
+      if (~word == 0) continue;
+
+      int id = static_cast<int>((i % n) << 6) + __builtin_ctzll(~word);
+      if (id > limit_) continue;
+      word |= 1ull << (id & 63);
+      hint_ = i % n;
+      ++used_;
+      return id;
+    }
+    return -1;
+  }
+
+  void release(int id) {
+    assert(id > 0 && id <= limit_ && used(id));
+    words_[id >> 6] &= ~(1ull << (id & 63));
+    if (static_cast<size_t>(id >> 6) < hint_) hint_ = id >> 6;
+    --used_;
+  }
+
+  bool used(int id) const { return (words_[id >> 6] >> (id & 63)) & 1; }
+  int in_use() const { return used_; }
+  int limit() const { return limit_; }
+
+ private:
+  int limit_;
+  int used_ = 0;
+  size_t hint_ = 0;
+  std::vector<uint64_t> words_;
+};
+
+class FcgiResponseHandler {
+ public:
+  virtual ~FcgiResponseHandler() {}
+
+  virtual void onStdout(int request_id, const Byte *data, size_t length) = 0;
+  virtual void onStderr(int request_id, const Byte *data, size_t length) {
+    (void)request_id, (void)data, (void)length;
+  }
+  virtual void onEnd(int request_id, int app_status, int protocol_status) = 0;
+};
+
+// Runs several requests over one connection. begin() reserves a request id
+// and sends BEGIN_REQUEST; params and stdin then go through the manager
+// with that id, and dispatch() routes responses back to each request's
+// handler by request_id(). Until probe() finds FCGI_MPXS_CONNS set, or
+// when the upstream answers with kCantMpxConn, only one request is in
+// flight at a time.
+//
+// submit() is the pipelined alternative to begin(): it writes a whole
+// request at once, so the next one can follow while earlier responses
+// are still streaming in. It is opt-in through set_pipeline_depth().
+class FcgiMultiplexer {
+ public:
+  static constexpr int kDefaultMaxRequests = 256;
+
+  explicit FcgiMultiplexer(FcgiManager &manager,
+                           int max_requests = kDefaultMaxRequests)
+      : manager_(manager),
+        reader_(manager),
+        ids_(max_requests),
+        handlers_(max_requests + 1, nullptr),
+        max_in_flight_(max_requests) {}
+
+  // Asks the upstream for its limits with GET_VALUES and applies them.
+  // Must run before any request is started on the connection.
+  int probe() {
+    assert(ids_.in_use() == 0);
+    FcgiUpstreamLimits limits;
+    if (manager_.getValues(&limits) < 0) return -1;
+    applyLimits(limits);
+    return 0;
+  }
+
+  // Uses limits obtained elsewhere, e.g. from FcgiLimitsCache: multiplexing
+  // follows FCGI_MPXS_CONNS and FCGI_MAX_REQS caps the requests in flight.
+  void applyLimits(const FcgiUpstreamLimits &limits) {
+    multiplexing_ = limits.mpxs_conns;
+    max_in_flight_ = ids_.limit();
+    if (limits.max_reqs > 0 && limits.max_reqs < max_in_flight_)
+      max_in_flight_ = limits.max_reqs;
+  }
+
+  bool multiplexing() const { return multiplexing_; }
+  int in_flight() const { return ids_.in_use(); }
+  int capacity() const { return multiplexing_ ? max_in_flight_ : 1; }
+
+  // Caps how many submitted requests may await END_REQUEST at once. The
+  // default of 1 waits for each response before the next submit(); more
+  // only takes effect while multiplexing() and within capacity().
+  void set_pipeline_depth(int depth) {
+    assert(depth > 0);
+    pipeline_depth_ = depth;
+  }
+
+  int pipeline_depth() const {
+    return pipeline_depth_ < capacity() ? pipeline_depth_ : capacity();
+  }
+
+  bool can_submit() const { return in_flight() < pipeline_depth(); }
+
+  // Sends BEGIN_REQUEST, params and stdin of one request with as few
+  // writes as possible: one for everything when the body fits a single
+  // record, which is the usual case for small requests. params is moved to
+  // the request id picked here. Blocks until the request is written;
+  // responses are routed by dispatch() as for begin(). Returns the request
+  // id, or -1 if the pipeline is full or the write failed, after which the
+  // connection should not be reused.
+  int submit(FcgiResponseHandler *handler, FcgiParamsBuilder &params,
+             const void *body = nullptr, size_t length = 0,
+             FcgiRole role = kRoleResponder) {
+    static constexpr int kStackSegments = 16;
+    if (!can_submit()) return -1;
+    int request_id = ids_.allocate();
+    if (request_id < 0) return -1;
+
+    params.finish();
+    params.set_request_id(request_id);
+    bool inline_body = length <= static_cast<size_t>(kFcgiMaxContentLength);
+    int padding = inline_body ? FcgiManager::paddingFor(length) : 0;
+
+    FcgiRequestBegin begin{
+        {kTypeBegin, sizeof(FcgiRequestBeginBody), request_id}, {role, true}};
+    FcgiHeader stdin_header(kTypeStdin, length, request_id, padding),
+        stdin_end(kTypeStdin, 0, request_id);
+
+    int wanted = params.segments() + 5;
+    iovec stack_iov[kStackSegments];
+    std::unique_ptr<iovec[]> heap_iov;
+    auto iov = stack_iov;
+    if (wanted > kStackSegments) {
+      heap_iov.reset(new iovec[wanted]);
+      iov = heap_iov.get();
+    }
+
+    int iovcnt = 0;
+    iov[iovcnt++] = {&begin, sizeof(begin)};
+    params.forEachSegment([&](const Byte *data, size_t size) {
+      iov[iovcnt++] = {const_cast<Byte *>(data), size};
+    });
+    if (inline_body && length > 0) {
+      iov[iovcnt++] = {&stdin_header, sizeof(stdin_header)};
+      iov[iovcnt++] = {const_cast<void *>(body), length};
+      iov[iovcnt++] = {const_cast<Byte *>(kFcgiPadding),
+                       static_cast<size_t>(padding)};
+    }
+    if (inline_body) iov[iovcnt++] = {&stdin_end, sizeof(stdin_end)};
+
+    manager_.traceBegin(request_id);
+    manager_.traceSent(kTypeBegin, 1, sizeof(begin));
+    manager_.traceSent(kTypeParams, params.records(), params.size());
+    if (inline_body)
+      manager_.traceSent(kTypeStdin, length > 0 ? 2 : 1,
+                         (length > 0 ? sizeof(stdin_header) : 0) + length +
+                             padding + sizeof(stdin_end));
+
+    manager_.doWritev(iov, iovcnt);
+    bool written = iov[iovcnt - 1].iov_len == 0;
+    if (written) manager_.traceParamsFlushed();
+    if (written && !inline_body)
+      written = manager_.sendStdin(request_id, body, length) >= 0 &&
+                manager_.endStdin(request_id) ==
+                    static_cast<int>(sizeof(FcgiHeader));
+    if (!written) {
+      ids_.release(request_id);
+      return -1;
+    }
+    if (inline_body) manager_.traceStdinFlushed();
+
+    handlers_[request_id] = handler;
+    return request_id;
+  }
+
+  // Returns the id of the new request, or -1 if the connection is full or
+  // BEGIN_REQUEST could not be sent.
+  int begin(FcgiResponseHandler *handler, FcgiRole role = kRoleResponder) {
+    if (in_flight() >= capacity()) return -1;
+    int request_id = ids_.allocate();
+    if (request_id < 0) return -1;
+
+    if (manager_.startParams(role, true, request_id) < 0) {
+      ids_.release(request_id);
+      return -1;
+    }
+    handlers_[request_id] = handler;
+    return request_id;
+  }
+
+  // Sends ABORT_REQUEST for request_id. Its handler is not called again;
+  // the remaining records are discarded and the id is only reused after
+  // the upstream's END_REQUEST, so the connection stays in service.
+  int abort(int request_id) {
+    if (request_id <= 0 || request_id > ids_.limit() ||
+        handlers_[request_id] == nullptr ||
+        handlers_[request_id] == &discard_)
+      return -1;
+
+    handlers_[request_id] = &discard_;
+    return manager_.abortRequest(request_id);
+  }
+
+  // Routes every record already buffered. Returns the number routed, or
+  // -1 if the stream is corrupt.
+  int dispatchBuffered() {
+    FcgiRecord record;
+    int routed = 0, res;
+    while ((res = reader_.parse(&record)) == 1) {
+      route(record);
+      ++routed;
+    }
+    return res < 0 ? -1 : routed;
+  }
+
+  // Receives once from the connection and routes what arrived. Returns the
+  // number of records routed, 0 on EOF and -1 on errors (EAGAIN included
+  // for non-blocking connections).
+  int dispatch() {
+    int routed = dispatchBuffered();
+    if (routed != 0) return routed;
+
+    auto received = reader_.fill();
+    if (received <= 0) return received;
+    return dispatchBuffered();
+  }
+
+  void route(const FcgiRecord &record) {
+    int id = record.request_id;
+    if (id <= 0 || id > ids_.limit() || handlers_[id] == nullptr) return;
+
+    auto handler = handlers_[id];
+    switch (record.type) {
+      case kTypeStdout:
+        handler->onStdout(id, record.content, record.content_length);
+        break;
+      case kTypeStderr:
+        handler->onStderr(id, record.content, record.content_length);
+        break;
+      case kTypeEnd:
+        if (record.protocol_status() == kCantMpxConn) multiplexing_ = false;
+        handlers_[id] = nullptr;
+        ids_.release(id);
+        handler->onEnd(id, record.app_status(), record.protocol_status());
+        break;
+    }
+  }
+
+  FcgiManager &manager() { return manager_; }
+
+ private:
+  FcgiManager &manager_;
+  FcgiResponseReader reader_;
+  FcgiRequestIdAllocator ids_;
+  struct DiscardHandler : FcgiResponseHandler {
+    void onStdout(int, const Byte *, size_t) override {}
+    void onEnd(int, int, int) override {}
+  };
+
+  std::vector<FcgiResponseHandler *> handlers_;
+  DiscardHandler discard_;
+  int max_in_flight_;
+  int pipeline_depth_ = 1;
+  bool multiplexing_ = false;
+};
+
+// An upstream to connect to: a TCP address and port, or a Unix socket path.
+struct FcgiEndpoint {
+  std::string address;
+  int port;
+  FcgiSocketOptions options;
+
+  explicit FcgiEndpoint(const std::string &path) : address(path), port(-1) {}
+  FcgiEndpoint(const std::string &address, int port)
+      : address(address), port(port) {}
+
+  bool local() const { return port < 0; }
+
+  std::string key() const {
+    return local() ? "unix:" + address
+                   : address + ":" + std::to_string(port);
+  }
+
+  // Returns a connected manager (still connecting in non-blocking mode), or
+  // nullptr if the connection could not be started, with ENAMETOOLONG for
+  // a socket path that does not fit sun_path.
+  std::unique_ptr<FcgiManager> connect(bool nonblocking = false) const {
+    if (local() && address.size() >= sizeof(sockaddr_un::sun_path)) {
+      errno = ENAMETOOLONG;
+      return nullptr;
+    }
+
+    std::unique_ptr<FcgiManager> manager;
+    if (local())
+      manager.reset(new FcgiManagerUnix());
+    else
+      manager.reset(new FcgiManagerINET());
+
+    manager->set_nonblocking(nonblocking);
+    manager->set_socket_options(options);
+    if (manager->start(address.c_str(), port) < 0 && !manager->connecting())
+      return nullptr;
+    return manager;
+  }
+
+  // Starts count non-blocking connects at once and waits up to timeout_ms
+  // for them together, so that n connections cost about one round trip. The
+  // ones that complete are appended to out, switched to the blocking mode
+  // asked for. Returns how many.
+  size_t connectMany(size_t count, int timeout_ms, bool nonblocking,
+                     std::vector<std::unique_ptr<FcgiManager>> *out) const {
+    size_t connected = 0;
+    std::vector<std::unique_ptr<FcgiManager>> pending;
+    for (size_t i = 0; i < count; ++i) {
+      auto manager = connect(true);
+      if (manager == nullptr) continue;
+      if (manager->connecting()) {
+        pending.push_back(std::move(manager));
+        continue;
+      }
+      manager->set_nonblocking(nonblocking);
+      out->push_back(std::move(manager));
+      ++connected;
+    }
+    if (pending.empty()) return connected;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) return connected;
+    size_t left = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      epoll_event event;
+      event.events = EPOLLOUT;
+      event.data.u64 = i;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, pending[i]->fd(), &event) == 0)
+        ++left;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+    epoll_event events[64];
+    while (left > 0) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (wait.count() <= 0) break;
+      int ready = epoll_wait(epfd, events, 64, static_cast<int>(wait.count()));
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready <= 0) break;
+
+      for (int i = 0; i < ready; ++i) {
+        auto &manager = pending[events[i].data.u64];
+        epoll_ctl(epfd, EPOLL_CTL_DEL, manager->fd(), nullptr);
+        --left;
+        if (manager->finishConnect() < 0) continue;
+        manager->set_nonblocking(nonblocking);
+        out->push_back(std::move(manager));
+        ++connected;
+      }
+    }
+    close(epfd);
+    return connected;
+  }
+};
+
+// GET_VALUES answers per endpoint, so that each upstream is asked once.
+class FcgiLimitsCache {
+ public:
+  static FcgiLimitsCache &global() {
+    static FcgiLimitsCache cache;
+    return cache;
+  }
+
+  // Returns the cached limits of endpoint, asking it over a connection of
+  // its own the first time.
+  int get(const FcgiEndpoint &endpoint, FcgiUpstreamLimits *limits) {
+    auto key = endpoint.key();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = limits_.find(key);
+      if (it != limits_.end()) {
+        *limits = it->second;
+        return 0;
+      }
+    }
+
+    auto manager = endpoint.connect();
+    if (manager == nullptr || manager->getValues(limits) < 0) return -1;
+    put(endpoint, *limits);
+    return 0;
+  }
+
+  void put(const FcgiEndpoint &endpoint, const FcgiUpstreamLimits &limits) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_[endpoint.key()] = limits;
+  }
+
+  // Forgets an endpoint, e.g. after it restarted with a new configuration.
+  void invalidate(const FcgiEndpoint &endpoint) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_.erase(endpoint.key());
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, FcgiUpstreamLimits> limits_;
+};
+
+// Thread-safe pool of keep-alive connections to one endpoint. Idle
+// connections are kept in LRU order: acquire() reuses the most recently
+// released one and the least recently used is closed when more than
+// max_idle pile up. At most max_total connections exist at any time.
+class FcgiConnectionPool {
+ public:
+  static constexpr size_t kDefaultMaxIdle = 16;
+  static constexpr size_t kDefaultMaxTotal = 64;
+  static constexpr int kDefaultConnectMillis = 1000;
+
+  explicit FcgiConnectionPool(const FcgiEndpoint &endpoint,
+                              size_t max_idle = kDefaultMaxIdle,
+                              size_t max_total = kDefaultMaxTotal,
+                              bool nonblocking = false)
+      : endpoint_(endpoint),
+        max_idle_(max_idle),
+        max_total_(max_total),
+        nonblocking_(nonblocking) {}
+
+  FcgiConnectionPool(const FcgiConnectionPool &) = delete;
+  FcgiConnectionPool &operator=(const FcgiConnectionPool &) = delete;
+
+  // Returns an idle connection that passes the liveness probe, or a fresh
+  // one. Returns nullptr with errno EBUSY when max_total is reached, which
+  // connect() never reports, or with the connect error.
+  std::unique_ptr<FcgiManager> acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!idle_.empty()) {
+      auto manager = std::move(idle_.back());
+      idle_.pop_back();
+      if (manager->alive()) return manager;
+      --total_;
+    }
+
+    if (total_ >= max_total_) {
+      errno = EBUSY;
+      return nullptr;
+    }
+    ++total_;
+    lock.unlock();
+
+    auto manager = endpoint_.connect(nonblocking_);
+    if (manager == nullptr) {
+      lock.lock();
+      --total_;
+    }
+    return manager;
+  }
+
+  // Takes a connection back once its END_REQUEST has been read. Unusable
+  // connections (reusable == false, or closed by the peer) are dropped.
+  // alive() tells the latter with one non-blocking peek, made before the
+  // lock is taken.
+  void release(std::unique_ptr<FcgiManager> manager, bool reusable = true) {
+    std::unique_ptr<FcgiManager> evicted;
+    if (!reusable || manager == nullptr || !manager->alive()) manager.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (manager == nullptr) {
+      --total_;
+      return;
+    }
+
+    idle_.push_back(std::move(manager));
+    if (idle_.size() > max_idle_) {
+      evicted = std::move(idle_.front());
+      idle_.pop_front();
+      --total_;
+    }
+  }
+
+  // Drops the idle connections that the upstream has closed and connects
+  // in parallel until min_idle are idle, within max_idle and max_total.
+  // Meant for startup and for FcgiPoolKeeper after an upstream restart, so
+  // that requests do not pay for connect. Returns how many were opened.
+  size_t prewarm(size_t min_idle, int timeout_ms = kDefaultConnectMillis) {
+    std::vector<std::unique_ptr<FcgiManager>> dead, fresh;
+    std::deque<std::unique_ptr<FcgiManager>> probed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      probed.swap(idle_);
+    }
+
+    // Probed without the lock, so acquire() and release() do not wait for
+    // one syscall per idle connection.
+    for (auto it = probed.begin(); it != probed.end();) {
+      if ((*it)->alive()) {
+        ++it;
+        continue;
+      }
+      dead.push_back(std::move(*it));
+      it = probed.erase(it);
+    }
+
+    size_t wanted;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      total_ -= dead.size();
+      // The survivors are older than anything released meanwhile.
+      idle_.insert(idle_.begin(), std::make_move_iterator(probed.begin()),
+                   std::make_move_iterator(probed.end()));
+      while (idle_.size() > max_idle_) {
+        dead.push_back(std::move(idle_.front()));
+        idle_.pop_front();
+        --total_;
+      }
+
+      if (min_idle > max_idle_) min_idle = max_idle_;
+      wanted = min_idle > idle_.size() ? min_idle - idle_.size() : 0;
+      auto room = max_total_ > total_ ? max_total_ - total_ : 0;
+      if (wanted > room) wanted = room;
+      total_ += wanted;
+    }
+
+    endpoint_.connectMany(wanted, timeout_ms, nonblocking_, &fresh);
+    std::lock_guard<std::mutex> lock(mutex_);
+    total_ -= wanted - fresh.size();
+    for (auto &manager : fresh) idle_.push_back(std::move(manager));
+    return fresh.size();
+  }
+
+  // Sizes the pool after the upstream's FCGI_MAX_CONNS, when it has one.
+  void applyLimits(const FcgiUpstreamLimits &limits) {
+    if (limits.max_conns <= 0) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_total_ = limits.max_conns;
+    if (max_idle_ > max_total_) max_idle_ = max_total_;
+  }
+
+  // Fetches the endpoint's limits through the global cache and applies them.
+  int probeLimits() {
+    FcgiUpstreamLimits limits;
+    if (FcgiLimitsCache::global().get(endpoint_, &limits) < 0) return -1;
+    applyLimits(limits);
+    return 0;
+  }
+
+  size_t idle() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+  size_t total() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_;
+  }
+
+  size_t max_total() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_total_;
+  }
+
+  const FcgiEndpoint &endpoint() const { return endpoint_; }
+
+ private:
+  FcgiEndpoint endpoint_;
+  size_t max_idle_;
+  size_t max_total_;
+  bool nonblocking_;
+
+  mutable std::mutex mutex_;
+  std::deque<std::unique_ptr<FcgiManager>> idle_;
+  size_t total_ = 0;
+};
+
+// Drop-in alternative to FcgiConnectionPool for many threads sharing an
+// upstream. Idle connections live in per-thread shards of lock-free slots;
+// a thread whose shard runs empty steals from the following shards before
+// connecting. There is no global LRU order: a release into a full shard
+// closes the connection instead.
+class FcgiShardedConnectionPool {
+ public:
+  explicit FcgiShardedConnectionPool(
+      const FcgiEndpoint &endpoint,
+      size_t max_idle = FcgiConnectionPool::kDefaultMaxIdle,
+      size_t max_total = FcgiConnectionPool::kDefaultMaxTotal,
+      bool nonblocking = false, size_t shards = 0)
+      : endpoint_(endpoint),
+        max_total_(max_total),
+        nonblocking_(nonblocking),
+        shard_count_(shards > 0 ? shards : defaultShards()),
+        slots_per_shard_((max_idle + shard_count_ - 1) / shard_count_),
+        shards_(new Shard[shard_count_]) {
+    if (slots_per_shard_ == 0) slots_per_shard_ = 1;
+    auto stride = (slots_per_shard_ + kSlotsPerLine - 1) / kSlotsPerLine *
+                  kSlotsPerLine;
+    auto count = stride * shard_count_;
+    storage_.reset(new std::atomic<FcgiManager *>[count + kSlotsPerLine - 1]);
+    auto base = storage_.get();
+    auto misalign = reinterpret_cast<uintptr_t>(base) % kCacheLine;
+    if (misalign > 0) base += (kCacheLine - misalign) / sizeof(*base);
+    for (size_t i = 0; i < count; ++i)
+      base[i].store(nullptr, std::memory_order_relaxed);
+    for (size_t i = 0; i < shard_count_; ++i)
+      shards_[i].slots = base + i * stride;
+  }
+
+  FcgiShardedConnectionPool(const FcgiShardedConnectionPool &) = delete;
+  FcgiShardedConnectionPool &operator=(const FcgiShardedConnectionPool &) =
+      delete;
+
+  ~FcgiShardedConnectionPool() {
+    for (size_t i = 0; i < shard_count_; ++i)
+      for (size_t j = 0; j < slots_per_shard_; ++j)
+        delete shards_[i].slots[j].load(std::memory_order_relaxed);
+  }
+
+  // As FcgiConnectionPool::acquire().
+  std::unique_ptr<FcgiManager> acquire() {
+    size_t home = shardIndex();
+    for (size_t i = 0; i < shard_count_; ++i) {
+      std::unique_ptr<FcgiManager> manager;
+      while ((manager = pop(shards_[(home + i) % shard_count_])) != nullptr) {
+        if (manager->alive()) return manager;
+        total_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+
+    auto total = total_.load(std::memory_order_relaxed);
+    do {
+      if (total >= max_total_.load(std::memory_order_relaxed)) {
+        errno = EBUSY;
+        return nullptr;
+      }
+    } while (!total_.compare_exchange_weak(total, total + 1,
+                                           std::memory_order_relaxed));
+
+    auto manager = endpoint_.connect(nonblocking_);
+    if (manager == nullptr) total_.fetch_sub(1, std::memory_order_relaxed);
+    return manager;
+  }
+
+  void release(std::unique_ptr<FcgiManager> manager, bool reusable = true) {
+    if (reusable && manager != nullptr && manager->alive() &&
+        push(shards_[shardIndex()], manager))
+      return;
+    manager.reset();
+    total_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // As FcgiConnectionPool::prewarm(); new connections are spread over the
+  // shards.
+  size_t prewarm(size_t min_idle,
+                 int timeout_ms = FcgiConnectionPool::kDefaultConnectMillis) {
+    std::vector<std::unique_ptr<FcgiManager>> fresh;
+    for (size_t i = 0; i < shard_count_; ++i) sweep(shards_[i]);
+
+    auto capacity = slots_per_shard_ * shard_count_;
+    if (min_idle > capacity) min_idle = capacity;
+    auto idle = idle_.load(std::memory_order_relaxed);
+    size_t wanted = min_idle > idle ? min_idle - idle : 0;
+    auto total = total_.load(std::memory_order_relaxed);
+    do {
+      auto max_total = max_total_.load(std::memory_order_relaxed);
+      auto room = max_total > total ? max_total - total : 0;
+      if (wanted > room) wanted = room;
+    } while (wanted > 0 &&
+             !total_.compare_exchange_weak(total, total + wanted,
+                                           std::memory_order_relaxed));
+
+    endpoint_.connectMany(wanted, timeout_ms, nonblocking_, &fresh);
+    total_.fetch_sub(wanted - fresh.size(), std::memory_order_relaxed);
+    size_t added = 0;
+    for (size_t i = 0; i < fresh.size(); ++i) {
+      if (pushAny(fresh[i], i)) {
+        ++added;
+      } else {
+        fresh[i].reset();
+        total_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+    return added;
+  }
+
+  // Idle slots per shard stay as constructed; only the total moves.
+  void applyLimits(const FcgiUpstreamLimits &limits) {
+    if (limits.max_conns > 0)
+      max_total_.store(limits.max_conns, std::memory_order_relaxed);
+  }
+
+  int probeLimits() {
+    FcgiUpstreamLimits limits;
+    if (FcgiLimitsCache::global().get(endpoint_, &limits) < 0) return -1;
+    applyLimits(limits);
+    return 0;
+  }
+
+  size_t idle() const { return idle_.load(std::memory_order_relaxed); }
+  size_t total() const { return total_.load(std::memory_order_relaxed); }
+  size_t max_total() const {
+    return max_total_.load(std::memory_order_relaxed);
+  }
+  const FcgiEndpoint &endpoint() const { return endpoint_; }
+
+ private:
+  static constexpr size_t kCacheLine = 64;
+  static constexpr size_t kSlotsPerLine =
+      kCacheLine / sizeof(std::atomic<FcgiManager *>);
+
+  // The slots of all shards share one allocation, each shard's starting on
+  // a cache line of its own and padded to whole lines, so that threads on
+  // neighbouring shards do not contend for a line. The Shard itself is
+  // never written after construction.
+  struct Shard {
+    std::atomic<FcgiManager *> *slots;
+  };
+
+  static size_t defaultShards() {
+    auto n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+  size_t shardIndex() const {
+    static std::atomic<size_t> next_thread{0};
+    static thread_local size_t thread_index =
+        next_thread.fetch_add(1, std::memory_order_relaxed);
+    return thread_index % shard_count_;
+  }
+
+  // A slot owns the connection it points to; exchange() hands ownership
+  // to exactly one thread, so there is no ABA to worry about.
+  std::unique_ptr<FcgiManager> pop(Shard &shard) {
+    for (size_t i = 0; i < slots_per_shard_; ++i) {
+      auto &slot = shard.slots[i];
+      if (slot.load(std::memory_order_relaxed) == nullptr) continue;
+
+      auto manager = slot.exchange(nullptr, std::memory_order_acquire);
+      if (manager != nullptr) {
+        idle_.fetch_sub(1, std::memory_order_relaxed);
+        return std::unique_ptr<FcgiManager>(manager);
+      }
+    }
+    return nullptr;
+  }
+
+  bool push(Shard &shard, std::unique_ptr<FcgiManager> &manager) {
+    for (size_t i = 0; i < slots_per_shard_; ++i) {
+      FcgiManager *expected = nullptr;
+      if (shard.slots[i].compare_exchange_strong(expected, manager.get(),
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed)) {
+        manager.release();
+        idle_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Probes the idle connections of a shard one slot at a time and puts
+  // each live one straight back, so the rest of the pool stays available.
+  void sweep(Shard &shard) {
+    for (size_t i = 0; i < slots_per_shard_; ++i) {
+      auto &slot = shard.slots[i];
+      if (slot.load(std::memory_order_relaxed) == nullptr) continue;
+
+      std::unique_ptr<FcgiManager> manager(
+          slot.exchange(nullptr, std::memory_order_acquire));
+      if (manager == nullptr) continue;
+      idle_.fetch_sub(1, std::memory_order_relaxed);
+      if (!manager->alive()) {
+        manager.reset();
+        total_.fetch_sub(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      FcgiManager *expected = nullptr;
+      if (slot.compare_exchange_strong(expected, manager.get(),
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+        manager.release();
+        idle_.fetch_add(1, std::memory_order_relaxed);
+      } else if (!pushAny(manager, 0)) {
+        manager.reset();
+        total_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool pushAny(std::unique_ptr<FcgiManager> &manager, size_t start) {
+    for (size_t i = 0; i < shard_count_; ++i)
+      if (push(shards_[(start + i) % shard_count_], manager)) return true;
+    return false;
+  }
+
+  FcgiEndpoint endpoint_;
+  std::atomic<size_t> max_total_;
+  bool nonblocking_;
+  size_t shard_count_;
+  size_t slots_per_shard_;
+  std::unique_ptr<std::atomic<FcgiManager *>[]> storage_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<size_t> total_{0};
+  std::atomic<size_t> idle_{0};
+};
+
+// Several endpoints serving the same application, each with a pool of its
+// own. acquire() picks the endpoint with the fewest requests in flight,
+// either by looking at all of them or, with kPowerOfTwoChoices, at two
+// picked at random; endpoints at their FCGI_MAX_REQS are skipped. An
+// endpoint that fails eject_after times in a row is left out for
+// eject_for, then tried again. Endpoints are added before the group is
+// shared; acquire() and release() are thread-safe.
+class FcgiUpstreamGroup {
+ public:
+  enum Policy { kLeastOutstanding, kPowerOfTwoChoices };
+
+  static constexpr int kDefaultEjectAfter = 3;
+  static constexpr int kDefaultEjectMillis = 10000;
+
+  // A connection checked out of the group, to be handed back through
+  // release() once the request is over.
+  struct Lease {
+    int upstream = -1;
+    std::unique_ptr<FcgiManager> manager;
+
+    explicit operator bool() const { return manager != nullptr; }
+  };
+
+  explicit FcgiUpstreamGroup(
+      Policy policy = kLeastOutstanding,
+      size_t max_idle = FcgiConnectionPool::kDefaultMaxIdle,
+      size_t max_total = FcgiConnectionPool::kDefaultMaxTotal,
+      bool nonblocking = false)
+      : policy_(policy),
+        max_idle_(max_idle),
+        max_total_(max_total),
+        nonblocking_(nonblocking) {}
+
+  FcgiUpstreamGroup(const FcgiUpstreamGroup &) = delete;
+  FcgiUpstreamGroup &operator=(const FcgiUpstreamGroup &) = delete;
+
+  void set_ejection(int eject_after, std::chrono::milliseconds eject_for) {
+    assert(eject_after > 0);
+    eject_after_ = eject_after;
+    eject_for_ = eject_for;
+  }
+
+  // Returns the index of the new endpoint.
+  int add(const FcgiEndpoint &endpoint) {
+    upstreams_.emplace_back(
+        new Upstream(endpoint, max_idle_, max_total_, nonblocking_));
+    return static_cast<int>(upstreams_.size()) - 1;
+  }
+
+  // Asks every endpoint for its limits through FcgiLimitsCache: pools are
+  // sized after FCGI_MAX_CONNS and FCGI_MAX_REQS caps the requests sent to
+  // each. Endpoints that do not answer keep their defaults and count a
+  // failure. Returns how many answered.
+  int probeLimits() {
+    int answered = 0;
+    for (size_t i = 0; i < upstreams_.size(); ++i) {
+      FcgiUpstreamLimits limits;
+      if (FcgiLimitsCache::global().get(endpoint(i), &limits) < 0) {
+        fail(*upstreams_[i]);
+        continue;
+      }
+      applyLimits(i, limits);
+      ++answered;
+    }
+    return answered;
+  }
+
+  void applyLimits(int upstream, const FcgiUpstreamLimits &limits) {
+    auto &target = *upstreams_[upstream];
+    target.pool.applyLimits(limits);
+    target.max_reqs.store(limits.max_reqs, std::memory_order_relaxed);
+  }
+
+  // Returns a connection to the least loaded healthy endpoint, trying the
+  // others when connecting fails. When every endpoint is ejected they are
+  // all tried anyway rather than failing outright. An empty lease means
+  // no endpoint could take the request.
+  Lease acquire() {
+    Lease lease;
+    std::vector<bool> tried(upstreams_.size(), false);
+    for (size_t attempt = 0; attempt < upstreams_.size(); ++attempt) {
+      int chosen = choose(tried);
+      if (chosen < 0) break;
+      tried[chosen] = true;
+
+      auto &upstream = *upstreams_[chosen];
+      if (!reserve(upstream)) continue;
+      lease.manager = upstream.pool.acquire();
+      if (lease.manager != nullptr) {
+        lease.upstream = chosen;
+        return lease;
+      }
+      // An exhausted pool is load, not a fault of the endpoint.
+      if (errno != EBUSY) fail(upstream);
+      upstream.outstanding.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return lease;
+  }
+
+  // Hands a connection back. ok == false means the request failed on it,
+  // e.g. a read error or EOF before END_REQUEST: the connection is dropped
+  // and counts against the endpoint's health.
+  void release(Lease &lease, bool ok = true) {
+    if (lease.upstream < 0) return;
+    auto &upstream = *upstreams_[lease.upstream];
+    upstream.outstanding.fetch_sub(1, std::memory_order_relaxed);
+    if (ok)
+      upstream.failures.store(0, std::memory_order_relaxed);
+    else
+      fail(upstream);
+    upstream.pool.release(std::move(lease.manager), ok);
+    lease.upstream = -1;
+  }
+
+  // Prewarms the pool of every endpoint; see FcgiConnectionPool::prewarm().
+  size_t prewarm(size_t min_idle,
+                 int timeout_ms = FcgiConnectionPool::kDefaultConnectMillis) {
+    size_t opened = 0;
+    for (auto &upstream : upstreams_)
+      opened += upstream->pool.prewarm(min_idle, timeout_ms);
+    return opened;
+  }
+
+  size_t size() const { return upstreams_.size(); }
+  const FcgiEndpoint &endpoint(int upstream) const {
+    return upstreams_[upstream]->pool.endpoint();
+  }
+  FcgiConnectionPool &pool(int upstream) { return upstreams_[upstream]->pool; }
+
+  int outstanding(int upstream) const {
+    return upstreams_[upstream]->outstanding.load(std::memory_order_relaxed);
+  }
+
+  bool healthy(int upstream) const {
+    return healthy(*upstreams_[upstream], now());
+  }
+
+ private:
+  struct Upstream {
+    Upstream(const FcgiEndpoint &endpoint, size_t max_idle, size_t max_total,
+             bool nonblocking)
+        : pool(endpoint, max_idle, max_total, nonblocking) {}
+
+    FcgiConnectionPool pool;
+    std::atomic<int> outstanding{0};
+    std::atomic<int> max_reqs{0};
+    std::atomic<int> failures{0};
+    std::atomic<int64_t> ejected_until{0};
+  };
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static bool healthy(const Upstream &upstream, int64_t now) {
+    return upstream.ejected_until.load(std::memory_order_relaxed) <= now;
+  }
+
+  static bool full(const Upstream &upstream) {
+    auto max_reqs = upstream.max_reqs.load(std::memory_order_relaxed);
+    return max_reqs > 0 &&
+           upstream.outstanding.load(std::memory_order_relaxed) >= max_reqs;
+  }
+
+  // Takes a slot under the endpoint's FCGI_MAX_REQS, if it still has one.
+  static bool reserve(Upstream &upstream) {
+    auto max_reqs = upstream.max_reqs.load(std::memory_order_relaxed);
+    auto outstanding = upstream.outstanding.load(std::memory_order_relaxed);
+    do {
+      if (max_reqs > 0 && outstanding >= max_reqs) return false;
+    } while (!upstream.outstanding.compare_exchange_weak(
+        outstanding, outstanding + 1, std::memory_order_relaxed));
+    return true;
+  }
+
+  void fail(Upstream &upstream) {
+    if (upstream.failures.fetch_add(1, std::memory_order_relaxed) + 1 <
+        eject_after_)
+      return;
+    upstream.failures.store(0, std::memory_order_relaxed);
+    upstream.ejected_until.store(now() + eject_for_.count(),
+                                 std::memory_order_relaxed);
+  }
+
+  int choose(const std::vector<bool> &tried) {
+    auto time = now();
+    int chosen = policy_ == kPowerOfTwoChoices ? pickTwo(tried, time) : -1;
+    if (chosen < 0) chosen = leastOutstanding(tried, time, true);
+    if (chosen < 0) chosen = leastOutstanding(tried, time, false);
+    return chosen;
+  }
+
+  bool eligible(int i, const std::vector<bool> &tried, int64_t time,
+                bool healthy_only) const {
+    auto &upstream = *upstreams_[i];
+    return !tried[i] && !full(upstream) &&
+           (!healthy_only || healthy(upstream, time));
+  }
+
+  // Scans from a rotating start so that ties do not all land on the first
+  // endpoint.
+  int leastOutstanding(const std::vector<bool> &tried, int64_t time,
+                       bool healthy_only) {
+    int n = static_cast<int>(upstreams_.size()), best = -1, best_load = 0;
+    if (n == 0) return -1;
+    int start = static_cast<int>(
+        next_.fetch_add(1, std::memory_order_relaxed) % n);
+    for (int k = 0; k < n; ++k) {
+      int i = (start + k) % n;
+      if (!eligible(i, tried, time, healthy_only)) continue;
+      int load = outstanding(i);
+      if (best < 0 || load < best_load) best = i, best_load = load;
+    }
+    return best;
+  }
+
+  int pickTwo(const std::vector<bool> &tried, int64_t time) {
+    int n = static_cast<int>(upstreams_.size());
+    if (n < 2) return -1;
+    int a = static_cast<int>(random() % n),
+        b = static_cast<int>(random() % (n - 1));
+    if (b >= a) ++b;
+
+    bool use_a = eligible(a, tried, time, true),
+         use_b = eligible(b, tried, time, true);
+    if (use_a && use_b) return outstanding(b) < outstanding(a) ? b : a;
+    return use_a ? a : use_b ? b : -1;
+  }
+
+  static uint64_t random() {
+    static thread_local uint64_t state =
+        reinterpret_cast<uintptr_t>(&state) ^ 0x9e3779b97f4a7c15ull;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  Policy policy_;
+  size_t max_idle_;
+  size_t max_total_;
+  bool nonblocking_;
+  int eject_after_ = kDefaultEjectAfter;
+  // Copied, since duration's constructor would bind the constant to a
+  // reference and need an out-of-line definition before C++17.
+  std::chrono::milliseconds eject_for_{static_cast<int>(kDefaultEjectMillis)};
+  std::vector<std::unique_ptr<Upstream>> upstreams_;
+  std::atomic<size_t> next_{0};
+};
+
+// Keeps pools warm from a thread of its own: every interval, and at once
+// after wake(), each pool drops the idle connections its upstream closed,
+// e.g. on a restart, and reconnects up to its min_idle. Request threads
+// then find connected sockets instead of paying for connect. Works with
+// FcgiConnectionPool, FcgiShardedConnectionPool and FcgiUpstreamGroup,
+// which must outlive the keeper; add them before start().
+class FcgiPoolKeeper {
+ public:
+  static constexpr int kDefaultIntervalMillis = 250;
+
+  explicit FcgiPoolKeeper(
+      int interval_ms = kDefaultIntervalMillis,
+      int connect_timeout_ms = FcgiConnectionPool::kDefaultConnectMillis)
+      : interval_(interval_ms), connect_timeout_ms_(connect_timeout_ms) {}
+
+  FcgiPoolKeeper(const FcgiPoolKeeper &) = delete;
+  FcgiPoolKeeper &operator=(const FcgiPoolKeeper &) = delete;
+
+  ~FcgiPoolKeeper() { stop(); }
+
+  template <typename Pool>
+  void add(Pool &pool, size_t min_idle) {
+    pools_.push_back({&prewarmPool<Pool>, &pool, min_idle});
+  }
+
+  // Prewarms every pool once before returning, then keeps them warm in
+  // the background.
+  void start() {
+    if (thread_.joinable()) return;
+    pass();
+    stopping_ = false;
+    thread_ = std::thread(&FcgiPoolKeeper::run, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Runs a pass now, e.g. when a request found its connection closed.
+  void wake() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      woken_ = true;
+    }
+    wakeup_.notify_one();
+  }
+
+ private:
+  struct Pool {
+    size_t (*prewarm)(void *pool, size_t min_idle, int timeout_ms);
+    void *pool;
+    size_t min_idle;
+  };
+
+  template <typename T>
+  static size_t prewarmPool(void *pool, size_t min_idle, int timeout_ms) {
+    return static_cast<T *>(pool)->prewarm(min_idle, timeout_ms);
+  }
+
+  void pass() {
+    for (auto &pool : pools_)
+      pool.prewarm(pool.pool, pool.min_idle, connect_timeout_ms_);
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      wakeup_.wait_for(lock, interval_, [this] { return stopping_ || woken_; });
+      if (stopping_) break;
+      woken_ = false;
+      lock.unlock();
+      pass();
+      lock.lock();
+    }
+  }
+
+  std::chrono::milliseconds interval_;
+  int connect_timeout_ms_;
+  std::vector<Pool> pools_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_ = false;
+  bool woken_ = false;
+};
+
+// Streams a request body of any size as padded STDIN records while the
+// rest of it is still arriving. On a non-blocking connection write() takes
+// only what the socket accepts; when blocked() is set afterwards, wait for
+// EPOLLOUT and offer the unaccepted bytes again.
+class FcgiStdinStream {
+ public:
+  FcgiStdinStream(const FcgiManager &manager, int request_id)
+      : manager_(manager), request_id_(request_id) {}
+
+  FcgiStdinStream(const FcgiStdinStream &) = delete;
+  FcgiStdinStream &operator=(const FcgiStdinStream &) = delete;
+
+  ~FcgiStdinStream() {
+    if (pipe_[0] >= 0) close(pipe_[0]);
+    if (pipe_[1] >= 0) close(pipe_[1]);
+  }
+
+  // Returns how many body bytes were accepted, or -1 on errors.
+  ssize_t write(const void *data, size_t length) {
+    assert(!pending() || source_ == kSourceBuffer);
+    source_ = kSourceBuffer;
+    auto src = static_cast<const Byte *>(data);
+    size_t accepted = 0;
+    blocked_ = false;
+
+    while (accepted < length || pending()) {
+      if (!pending()) startRecord(length - accepted);
+
+      size_t payload = length - accepted;
+      if (payload > record_left_) payload = record_left_;
+      bool completes = payload == record_left_;
+
+      iovec iov[] = {
+          {header_ + sizeof(header_) - header_left_, header_left_},
+          {const_cast<Byte *>(src + accepted), payload},
+          {const_cast<Byte *>(kFcgiPadding) + 8 - padding_left_,
+           completes ? padding_left_ : 0}};
+      size_t wanted = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+      if (wanted == 0) break;
+
+      auto written = manager_.doWritev(iov, 3);
+      if (written < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        blocked_ = true;
+        break;
+      }
+      accepted += advance(written);
+      if (static_cast<size_t>(written) < wanted) {
+        blocked_ = true;
+        break;
+      }
+    }
+    return accepted;
+  }
+
+  // Moves up to length body bytes from fd to the connection without
+  // copying them through userspace: sendfile() for regular files, splice()
+  // through a pipe for sockets and pipes. Only record headers and padding
+  // are written from here. Returns how many bytes were taken from fd (0 once
+  // it reaches EOF) or -1 on errors; blocked() means the connection is full,
+  // and a record in flight is finished by the next call. Records from a
+  // regular file are sized after what it holds, so a file shorter than
+  // length ends the call early rather than mid-record. sendfile() and
+  // splice() take no MSG_NOSIGNAL, so ignore SIGPIPE when using this.
+  ssize_t writeFrom(int fd, size_t length) {
+    assert(!pending() || source_ != kSourceBuffer);
+    if (!pending()) {
+      struct stat st;
+      if (fstat(fd, &st) < 0) return -1;
+      source_ = S_ISREG(st.st_mode) ? kSourceFile : kSourcePipe;
+      if (source_ == kSourcePipe && pipe_[0] < 0 && openPipe() < 0) return -1;
+    }
+
+    size_t taken = 0;
+    blocked_ = false;
+    while (taken < length || pending()) {
+      if (!pending()) {
+        auto chunk = length - taken;
+        if (chunk > static_cast<size_t>(kFcgiMaxContentLength))
+          chunk = kFcgiMaxContentLength;
+
+        if (source_ == kSourcePipe) {
+          auto moved = ::splice(fd, nullptr, pipe_[1], nullptr, chunk,
+                                SPLICE_F_MOVE | spliceFlags());
+          manager_.traceSyscall();
+          if (moved < 0) {
+            if (errno == EAGAIN) break;
+            return taken > 0 ? static_cast<ssize_t>(taken) : -1;
+          }
+          if (moved == 0) break;
+          taken += moved;
+          chunk = moved;
+        } else {
+          // The header goes out first, so it may only promise what the
+          // file still holds.
+          struct stat st;
+          auto offset = lseek(fd, 0, SEEK_CUR);
+          if (offset < 0 || fstat(fd, &st) < 0)
+            return taken > 0 ? static_cast<ssize_t>(taken) : -1;
+          if (offset >= st.st_size) break;
+          if (chunk > static_cast<size_t>(st.st_size - offset))
+            chunk = st.st_size - offset;
+        }
+        startRecord(chunk);
+      }
+
+      if (!sendFraming(header_ + sizeof(header_), header_left_, MSG_MORE))
+        break;
+
+      while (record_left_ > 0) {
+        ssize_t moved =
+            source_ == kSourceFile
+                ? ::sendfile(manager_.fd(), fd, nullptr, record_left_)
+                : ::splice(pipe_[0], nullptr, manager_.fd(), nullptr,
+                           record_left_, SPLICE_F_MOVE | spliceFlags());
+        manager_.traceSyscall();
+        if (moved <= 0) {
+          if (moved < 0 && errno == EINTR) continue;
+          // The file shrank under a record whose header is already out.
+          if (moved == 0) errno = EIO;
+          if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            blocked_ = true;
+            return taken;
+          }
+          return -1;
+        }
+        record_left_ -= moved;
+        if (source_ == kSourceFile) taken += moved;
+      }
+
+      if (!sendFraming(kFcgiPadding + 8, padding_left_, 0)) break;
+    }
+    if (blocked_ || !pending()) return taken;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? taken : -1;
+  }
+
+  // Sends the empty record that ends the body. Returns 1 once it is out,
+  // 0 if the socket is full (call again on EPOLLOUT) and -1 on errors.
+  int end() {
+    assert(record_left_ == 0);
+    source_ = kSourceBuffer;
+    if (!ended_) {
+      startRecord(0);
+      ended_ = true;
+    }
+    if (write(nullptr, 0) < 0) return -1;
+    if (pending()) return 0;
+    manager_.traceStdinFlushed();
+    return 1;
+  }
+
+  bool blocked() const { return blocked_; }
+  int request_id() const { return request_id_; }
+
+ private:
+  enum Source { kSourceBuffer, kSourceFile, kSourcePipe };
+
+  bool pending() const {
+    return header_left_ > 0 || record_left_ > 0 || padding_left_ > 0;
+  }
+
+  int openPipe() {
+    if (pipe2(pipe_, O_CLOEXEC) < 0) return -1;
+    // One whole record must fit, which the default 64 KiB already almost does.
+    fcntl(pipe_[1], F_SETPIPE_SZ, kFcgiMaxContentLength + 1);
+    return 0;
+  }
+
+  unsigned spliceFlags() const {
+    return manager_.nonblocking() ? SPLICE_F_NONBLOCK : 0;
+  }
+
+  // Writes the last left bytes ending at end; false if that did not finish.
+  bool sendFraming(const Byte *end, size_t &left, int flags) {
+    while (left > 0) {
+      auto written = manager_.doWrite(end - left, left, flags);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) blocked_ = true;
+        return false;
+      }
+      left -= written;
+    }
+    return true;
+  }
+
+  void startRecord(size_t available) {
+    auto length = available < static_cast<size_t>(kFcgiMaxContentLength)
+                      ? available
+                      : static_cast<size_t>(kFcgiMaxContentLength);
+    auto padding = FcgiManager::paddingFor(length);
+
+    new (header_) FcgiHeader(kTypeStdin, length, request_id_, padding);
+    manager_.traceSent(kTypeStdin, 1, sizeof(header_) + length + padding);
+    header_left_ = sizeof(header_);
+    record_left_ = length;
+    padding_left_ = padding;
+  }
+
+  // Accounts for written bytes; returns how many of them were body bytes.
+  size_t advance(size_t written) {
+    auto step = [&written](size_t &left) -> size_t {
+      auto n = written < left ? written : left;
+      left -= n;
+      written -= n;
+      return n;
+    };
+    step(header_left_);
+    auto payload = step(record_left_);
+    step(padding_left_);
+    return payload;
+  }
+
+  const FcgiManager &manager_;
+  int request_id_;
+  Byte header_[sizeof(FcgiHeader)];
+  size_t header_left_ = 0;
+  size_t record_left_ = 0;
+  size_t padding_left_ = 0;
+  bool blocked_ = false;
+  bool ended_ = false;
+  Source source_ = kSourceBuffer;
+  int pipe_[2] = {-1, -1};
+};
+
+// One request as received by an FcgiServerConnection. Params and body are
+// kept as they arrived, and params() indexes them in place.
+class FcgiServerRequest {
+ public:
+  using Param = FcgiParamsView::Entry;
+
+  FcgiServerRequest(int request_id, FcgiRole role, bool keep_alive)
+      : request_id_(request_id), role_(role), keep_alive_(keep_alive) {}
+
+  FcgiServerRequest(const FcgiServerRequest &) = delete;
+  FcgiServerRequest &operator=(const FcgiServerRequest &) = delete;
+
+  int request_id() const { return request_id_; }
+  FcgiRole role() const { return role_; }
+  bool keep_alive() const { return keep_alive_; }
+
+  const FcgiParamsView &params() const { return params_; }
+  size_t param_count() const { return params_.size(); }
+  const Param &param(size_t i) const { return params_[i]; }
+
+  // Names and values are not NUL-terminated; use the lengths in Param.
+  const char *name(const Param &param) const { return params_.name(param); }
+  const char *value(const Param &param) const { return params_.value(param); }
+
+  // Returns the value of the param called name, or nullptr without one.
+  const char *get(FcgiParamsView::Key key, size_t *length = nullptr) const {
+    return params_.get(key, length);
+  }
+  const char *find(const char *name, size_t *length = nullptr) const {
+    return params_.find(name, length);
+  }
+
+  const Byte *stdin_data() const { return stdin_.data(); }
+  size_t stdin_length() const { return stdin_.size(); }
+
+  // The FCGI_DATA stream of the filter role.
+  const Byte *filter_data() const { return data_.data(); }
+  size_t filter_data_length() const { return data_.size(); }
+
+ private:
+  friend class FcgiServerConnection;
+
+  // Indexes the params stream once it is complete. Returns false if it is
+  // malformed.
+  bool indexParams() {
+    params_done_ = true;
+    return params_.parse(raw_.data(), raw_.size());
+  }
+
+  bool ready() const {
+    return params_done_ && stdin_done_ && (role_ != kRoleFilter || data_done_);
+  }
+
+  int request_id_;
+  FcgiRole role_;
+  bool keep_alive_;
+  bool params_done_ = false;
+  bool stdin_done_ = false;
+  bool data_done_ = false;
+  bool stderr_used_ = false;
+  bool ended_ = false;
+  FcgiBuffer raw_;
+  FcgiParamsView params_;
+  FcgiBuffer stdin_;
+  FcgiBuffer data_;
+};
+
+class FcgiServerConnection;
+
+class FcgiRequestHandler {
+ public:
+  virtual ~FcgiRequestHandler() {}
+
+  // Called once the params and the whole body of a request have arrived.
+  // Output goes through connection.sendStdout() and sendStderr(); the
+  // return value is the app status sent with END_REQUEST.
+  virtual int onRequest(FcgiServerRequest &request,
+                        FcgiServerConnection &connection) = 0;
+};
+
+// The application side of one accepted connection: turns incoming records
+// into FcgiServerRequests, answers GET_VALUES from limits and writes the
+// response records. Requests are handled one after another on the calling
+// thread; several may be open at once only with limits.mpxs_conns.
+class FcgiServerConnection : public FcgiManager {
+ public:
+  explicit FcgiServerConnection(
+      int fd, const FcgiUpstreamLimits &limits = FcgiUpstreamLimits())
+      : limits_(limits), reader_(*this) {
+    set_fcgifd(fd);
+  }
+
+  // Accepted connections are not started; this always fails.
+  int start(const char *, int) override {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  ssize_t sendStdout(int request_id, const void *data, size_t length) const {
+    return sendStream(kTypeStdout, request_id, data, length);
+  }
+
+  ssize_t sendStderr(int request_id, const void *data, size_t length) {
+    auto it = requests_.find(request_id);
+    if (it != requests_.end()) it->second->stderr_used_ = true;
+    return sendStream(kTypeStderr, request_id, data, length);
+  }
+
+  // Closes the output streams and sends END_REQUEST in one write. The
+  // request is forgotten once serve() regains control.
+  int endRequest(int request_id, int app_status,
+                 FcgiProtocolStatus protocol_status = kRequestComplete) {
+    bool stderr_used = false;
+    auto it = requests_.find(request_id);
+    if (it != requests_.end()) {
+      if (it->second->ended_) return 0;
+      it->second->ended_ = true;
+      stderr_used = it->second->stderr_used_;
+    }
+
+    FcgiHeader stdout_end(kTypeStdout, 0, request_id),
+        stderr_end(kTypeStderr, 0, request_id);
+    FcgiRequestEnd end{{kTypeEnd, sizeof(FcgiRequestEndBody), request_id},
+                       {app_status, protocol_status}};
+    bool stream = protocol_status == kRequestComplete;
+    stderr_used = stream && stderr_used;
+    iovec iov[] = {{&stdout_end, stream ? sizeof(stdout_end) : 0},
+                   {&stderr_end, stderr_used ? sizeof(stderr_end) : 0},
+                   {&end, sizeof(end)}};
+    auto length = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    traceSent(kTypeEnd, 1, sizeof(end));
+    return emit(iov, 3, true) == static_cast<ssize_t>(length) ? 0 : -1;
+  }
+
+  // Handles requests until the peer closes the connection or a request
+  // without FCGI_KEEP_CONN ends. Returns 0 then, or -1 on errors.
+  int serve(FcgiRequestHandler &handler) {
+    FcgiRecord record;
+    int res;
+    while ((res = reader_.next(&record)) == 1) {
+      res = onRecord(record, handler);
+      if (res <= 0) return res;
+    }
+    return res;
+  }
+
+ private:
+  // Returns 1 to go on, 0 to close the connection and -1 on errors.
+  int onRecord(const FcgiRecord &record, FcgiRequestHandler &handler) {
+    int id = record.request_id;
+    if (id == 0) return onManagement(record);
+
+    if (record.type == kTypeBegin) return onBegin(record);
+
+    auto it = requests_.find(id);
+    if (it == requests_.end()) return 1;  // not ours, or already ended
+    auto &request = *it->second;
+
+    switch (record.type) {
+      case kTypeParams:
+        if (record.content_length > 0)
+          request.raw_.append(record.content, record.content_length);
+        else if (!request.indexParams())
+          return endAndErase(it, 0, kRequestComplete);
+        break;
+      case kTypeStdin:
+        if (record.content_length > 0)
+          request.stdin_.append(record.content, record.content_length);
+        else
+          request.stdin_done_ = true;
+        break;
+      case kTypeData:
+        if (record.content_length > 0)
+          request.data_.append(record.content, record.content_length);
+        else
+          request.data_done_ = true;
+        break;
+      case kTypeAbort:
+        return endAndErase(it, 0, kRequestComplete);
+      default:
+        return 1;
+    }
+
+    if (!request.ready()) return 1;
+    int app_status = handler.onRequest(request, *this);
+    return endAndErase(it, app_status, kRequestComplete);
+  }
+
+  int onBegin(const FcgiRecord &record) {
+    int id = record.request_id;
+    if (record.content_length < sizeof(FcgiRequestBeginBody) ||
+        requests_.count(id) > 0)
+      return 1;
+
+    FcgiRequestBeginBody body;
+    memcpy(&body, record.content, sizeof(body));
+    if (!limits_.mpxs_conns && !requests_.empty())
+      return endRequest(id, 0, kCantMpxConn) < 0 ? -1 : 1;
+    if (body.role() < kRoleResponder || body.role() > kRoleFilter)
+      return endRequest(id, 0, kUnknownRole) < 0 ? -1 : 1;
+
+    requests_[id].reset(new FcgiServerRequest(
+        id, static_cast<FcgiRole>(body.role()), body.keep_alive()));
+    return 1;
+  }
+
+  using RequestMap =
+      std::unordered_map<int, std::unique_ptr<FcgiServerRequest>>;
+
+  int endAndErase(RequestMap::iterator it, int app_status,
+                  FcgiProtocolStatus protocol_status) {
+    bool keep_alive = it->second->keep_alive();
+    int res = endRequest(it->first, app_status, protocol_status);
+    requests_.erase(it);
+    if (res < 0) return -1;
+    return keep_alive ? 1 : 0;
+  }
+
+  int onManagement(const FcgiRecord &record) {
+    if (record.type == kTypeGetValues) return sendValues(record);
+
+    FcgiHeader header(kTypeUnknown, sizeof(FcgiUnknownTypeBody), 0);
+    FcgiUnknownTypeBody body;
+    memset(&body, 0, sizeof(body));
+    body.type = record.type;
+    iovec iov[] = {{&header, sizeof(header)}, {&body, sizeof(body)}};
+    return doWritev(iov, 2) < 0 ? -1 : 1;
+  }
+
+  // Answers the variables of a GET_VALUES record that limits_ knows.
+  int sendValues(const FcgiRecord &record) {
+    FcgiNameValueParser parser(record.content, record.content_length);
+    const Byte *name, *value;
+    size_t name_length, value_length;
+    FcgiBuffer body;
+
+    while (parser.next(&name, &name_length, &value, &value_length) == 1) {
+      int number;
+      switch (FcgiParamsView::wellKnown(name, name_length)) {
+        case FcgiParamsView::kMaxConns:
+          number = limits_.max_conns;
+          break;
+        case FcgiParamsView::kMaxReqs:
+          number = limits_.max_reqs;
+          break;
+        case FcgiParamsView::kMpxsConns:
+          number = limits_.mpxs_conns ? 1 : 0;
+          break;
+        default:
+          continue;
+      }
+
+      auto text = std::to_string(number);
+      auto out = body.grow(FcgiParams::kMaxSize + name_length + text.size());
+      auto prefix = FcgiParams::encode(out, name_length, text.size());
+      memcpy(out + prefix, name, name_length);
+      memcpy(out + prefix + name_length, text.data(), text.size());
+      body.truncate(out - body.data() + prefix + name_length + text.size());
+    }
+
+    auto padding = paddingFor(body.size());
+    FcgiHeader header(kTypeValueResult, body.size(), 0, padding);
+    iovec iov[] = {{&header, sizeof(header)},
+                   {body.data(), body.size()},
+                   {const_cast<Byte *>(kFcgiPadding),
+                    static_cast<size_t>(padding)}};
+    return doWritev(iov, 3) < 0 ? -1 : 1;
+  }
+
+  FcgiUpstreamLimits limits_;
+  FcgiResponseReader reader_;
+  RequestMap requests_;
+};
+
+// Accepts connections on an endpoint and serves them on worker threads,
+// one connection at a time per worker as FastCGI application processes
+// do. With TCP every worker accepts on a listener of its own, bound with
+// SO_REUSEPORT, so the kernel spreads connections across workers without
+// a shared accept queue; a Unix socket is shared by all workers.
+class FcgiServer {
+ public:
+  static constexpr int kDefaultBacklog = 1024;
+
+  explicit FcgiServer(FcgiRequestHandler &handler,
+                      const FcgiUpstreamLimits &limits = FcgiUpstreamLimits())
+      : handler_(handler), limits_(limits), endpoint_(std::string()) {}
+
+  FcgiServer(const FcgiServer &) = delete;
+  FcgiServer &operator=(const FcgiServer &) = delete;
+
+  ~FcgiServer() {
+    stop();
+    for (auto fd : listeners_) close(fd);
+    if (endpoint_.local() && !endpoint_.address.empty())
+      unlink(endpoint_.address.c_str());
+  }
+
+  // Binds the endpoint; a stale Unix socket file is replaced. With TCP
+  // port 0 the kernel picks a port, which port() then tells. Returns 0 or
+  // -1 with errno set.
+  int listen(const FcgiEndpoint &endpoint, int backlog = kDefaultBacklog) {
+    endpoint_ = endpoint;
+    backlog_ = backlog;
+    if (endpoint_.local()) unlink(endpoint_.address.c_str());
+    return openListener() < 0 ? -1 : 0;
+  }
+
+  int port() const { return endpoint_.port; }
+
+  // Serves on threads workers, one per CPU by default, until stop().
+  // Returns 0, or -1 if the workers' listeners could not be opened.
+  int run(int threads = 0) {
+    if (listeners_.empty()) return -1;
+    if (threads <= 0) threads = static_cast<int>(defaultThreads());
+    std::vector<std::thread> workers;
+
+    for (int i = 0; i < threads; ++i) {
+      int fd = i == 0 || endpoint_.local() ? listeners_[0] : openListener();
+      if (fd < 0) break;
+      workers.emplace_back(&FcgiServer::work, this, fd);
+    }
+    int res = static_cast<int>(workers.size()) == threads ? 0 : -1;
+    if (res < 0) stop();
+    for (auto &worker : workers) worker.join();
+    return res;
+  }
+
+  // Wakes workers blocked in accept(); connections being served run until
+  // they end. Safe to call from any thread.
+  void stop() {
+    stopping_.store(true, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto fd : listeners_) shutdown(fd, SHUT_RDWR);
+  }
+
+ private:
+  static unsigned defaultThreads() {
+    auto n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+  int openListener() {
+    if (endpoint_.local() &&
+        endpoint_.address.size() >= sizeof(sockaddr_un::sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    int domain = endpoint_.local() ? AF_UNIX : AF_INET,
+        fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int res;
+    if (endpoint_.local()) {
+      sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      memcpy(addr.sun_path, endpoint_.address.data(),
+             endpoint_.address.size());
+      res = bind(fd, (sockaddr *)&addr, sizeof(addr));
+    } else {
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+      sockaddr_in addr;
+      socklen_t length = sizeof(addr);
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(endpoint_.port);
+      if (inet_pton(AF_INET, endpoint_.address.c_str(), &addr.sin_addr) != 1) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+      }
+      res = bind(fd, (sockaddr *)&addr, sizeof(addr));
+      if (res == 0 && endpoint_.port == 0 &&
+          getsockname(fd, (sockaddr *)&addr, &length) == 0)
+        endpoint_.port = ntohs(addr.sin_port);
+    }
+
+    if (res < 0 || ::listen(fd, backlog_) < 0) {
+      close(fd);
+      return -1;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    listeners_.push_back(fd);
+    return fd;
+  }
+
+  void work(int listener) {
+    while (!stopping_.load(std::memory_order_relaxed)) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        // Out of descriptors: back off until connections close.
+        if (errno == EMFILE || errno == ENFILE) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          continue;
+        }
+        return;
+      }
+      FcgiServerConnection connection(fd, limits_);
+      connection.serve(handler_);
+    }
+  }
+
+  FcgiRequestHandler &handler_;
+  FcgiUpstreamLimits limits_;
+  FcgiEndpoint endpoint_;
+  int backlog_ = kDefaultBacklog;
+  std::atomic<bool> stopping_{false};
+  std::mutex mutex_;
+  std::vector<int> listeners_;
+};
+
+#ifdef PFASTCGI_HAS_COROUTINES
+// Lazily started coroutine returning T. Awaiting it runs it to completion
+// and resumes the awaiting coroutine; top-level tasks are handed to
+// FcgiEventLoop::spawn(). Results follow the rest of the library: -1 with
+// errno set on errors.
+template <typename T>
+class FcgiTask;
+
+namespace detail {
+
+template <typename T>
+struct FcgiTaskPromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      auto continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() const noexcept { std::terminate(); }
+
+  std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct FcgiTaskPromise : FcgiTaskPromiseBase<T> {
+  FcgiTask<T> get_return_object() noexcept;
+  void return_value(T value) noexcept { result = std::move(value); }
+  T take() { return std::move(result); }
+
+  T result{};
+};
+
+template <>
+struct FcgiTaskPromise<void> : FcgiTaskPromiseBase<void> {
+  FcgiTask<void> get_return_object() noexcept;
+  void return_void() const noexcept {}
+  void take() const {}
+};
+
+}  // namespace detail
+
+template <typename T = void>
+class FcgiTask {
+ public:
+  using promise_type = detail::FcgiTaskPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit FcgiTask(Handle handle) : handle_(handle) {}
+  FcgiTask(FcgiTask &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {}
+  FcgiTask &operator=(FcgiTask &&other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  FcgiTask(const FcgiTask &) = delete;
+  FcgiTask &operator=(const FcgiTask &) = delete;
+
+  ~FcgiTask() {
+    if (handle_) handle_.destroy();
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+  void resume() { handle_.resume(); }
+
+  bool await_ready() const noexcept { return done(); }
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> continuation) noexcept {
+    handle_.promise().continuation = continuation;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().take(); }
+
+ private:
+  Handle handle_;
+};
+
+namespace detail {
+
+template <typename T>
+FcgiTask<T> FcgiTaskPromise<T>::get_return_object() noexcept {
+  return FcgiTask<T>(FcgiTask<T>::Handle::from_promise(*this));
+}
+
+inline FcgiTask<void> FcgiTaskPromise<void>::get_return_object() noexcept {
+  return FcgiTask<void>(FcgiTask<void>::Handle::from_promise(*this));
+}
+
+}  // namespace detail
+
+// Single-threaded epoll loop that resumes coroutines once their socket is
+// ready. Each fd has at most one waiter at a time, which is what one
+// coroutine per connection gives.
+class FcgiEventLoop {
+ public:
+  // Suspends until fd reports one of events, or for at most timeout
+  // milliseconds unless that is 0. await_resume() gives 0, or -1 with
+  // errno set if the fd could not be watched or to ETIMEDOUT.
+  class Readiness {
+   public:
+    Readiness(FcgiEventLoop &loop, int fd, uint32_t events,
+              uint64_t timeout = 0)
+        : loop_(loop), fd_(fd), events_(events), timeout_(timeout) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+      if (loop_.watch(fd_, events_, handle) < 0) {
+        error_ = errno;
+        return false;
+      }
+      if (timeout_ > 0) {
+        handle_ = handle;
+        timer_.set_callback(onTimeout, this);
+        loop_.arm(timer_, timeout_);
+      }
+      return true;
+    }
+    int await_resume() noexcept {
+      timer_.cancel();
+      if (error_ == 0) return 0;
+      errno = error_;
+      return -1;
+    }
+
+   private:
+    // Runs from run()'s advance(), after the fd events of that wakeup were
+    // handled, so the fd cannot resume the waiter a second time.
+    static void onTimeout(FcgiTimer &, void *context) {
+      auto self = static_cast<Readiness *>(context);
+      self->loop_.unwatch(self->fd_);
+      self->error_ = ETIMEDOUT;
+      self->handle_.resume();
+    }
+
+    FcgiEventLoop &loop_;
+    int fd_;
+    uint32_t events_;
+    uint64_t timeout_;
+    int error_ = 0;
+    std::coroutine_handle<> handle_;
+    FcgiTimer timer_;
+  };
+
+  FcgiEventLoop() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {}
+  FcgiEventLoop(const FcgiEventLoop &) = delete;
+  FcgiEventLoop &operator=(const FcgiEventLoop &) = delete;
+
+  ~FcgiEventLoop() {
+    if (epfd_ >= 0) close(epfd_);
+  }
+
+  bool ok() const { return epfd_ >= 0; }
+
+  Readiness readable(int fd, uint64_t timeout = 0) {
+    return Readiness(*this, fd, EPOLLIN, timeout);
+  }
+  Readiness writable(int fd, uint64_t timeout = 0) {
+    return Readiness(*this, fd, EPOLLOUT, timeout);
+  }
+
+  // Timers advanced by run() on every wakeup, e.g. for FcgiDeadlines.
+  FcgiTimerWheel &timers() { return timers_; }
+
+  // Starts the task right away; the loop owns it until it finishes.
+  void spawn(FcgiTask<> task) {
+    task.resume();
+    if (!task.done()) tasks_.push_back(std::move(task));
+  }
+
+  // Resumes waiters until every spawned task has finished, firing due
+  // timers in between, so that a Readiness timeout wakes its waiter even
+  // though the fd stays quiet. Timers with no waiter behind them do not
+  // keep the loop going. Returns 0, or -1 if epoll_wait() fails.
+  int run() {
+    epoll_event events[64];
+    while (waiting_ > 0) {
+      int count = epoll_wait(epfd_, events, 64, timers_.timeout());
+      if (count < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+
+      for (int i = 0; i < count; ++i) {
+        --waiting_;
+        std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+      }
+      timers_.advance();
+      reap();
+    }
+    reap();
+    return 0;
+  }
+
+ private:
+  // One-shot registration, so a fired fd stays quiet until watched again.
+  int watch(int fd, uint32_t events, std::coroutine_handle<> handle) {
+    epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = handle.address();
+    if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event) < 0 &&
+        (errno != ENOENT || epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event) < 0))
+      return -1;
+    ++waiting_;
+    return 0;
+  }
+
+  // Drops the registration of a waiter that timed out. Deleting it rather
+  // than clearing its events keeps EPOLLERR and EPOLLHUP, which epoll
+  // always reports, from resuming the waiter later.
+  void unwatch(int fd) {
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    --waiting_;
+  }
+
+  // Counts timeout from the clock rather than from the wheel's last
+  // advance(), which may be a while back when a task starts before run().
+  void arm(FcgiTimer &timer, uint64_t timeout) {
+    timers_.schedule(timer, timeout + FcgiTimerWheel::now_ms() - timers_.now());
+  }
+
+  void reap() {
+    for (size_t i = 0; i < tasks_.size();) {
+      if (tasks_[i].done()) {
+        tasks_[i] = std::move(tasks_.back());
+        tasks_.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  int epfd_;
+  int waiting_ = 0;
+  std::vector<FcgiTask<>> tasks_;
+  FcgiTimerWheel timers_;
+};
+
+// co_await-able counterparts of the FcgiManager calls for one connection
+// on an FcgiEventLoop. Each suspends while the socket is not ready, so a
+// request reads as straight-line code:
+//
+//   FcgiTask<> call(FcgiEventLoop &loop, FcgiManagerUnix &manager) {
+//     FcgiCoConnection conn(loop, manager);
+//     int res = co_await conn.connect("/run/php-fpm.sock", 0);
+//     if (res < 0) co_return;
+//     res = co_await conn.startParams(kRoleResponder, false, 1);
+//     ...
+//     FcgiRecord record;
+//     while ((res = co_await conn.nextRecord(1, &record)) == 1) ...
+//   }
+//
+// The manager is switched to non-blocking mode. Only one call may be in
+// progress at a time. Results are awaited into locals rather than inside
+// conditions, which GCC 12 miscompiles. With set_deadlines(), each wait
+// is bounded by timers on the loop's wheel.
+class FcgiCoConnection {
+ public:
+  FcgiCoConnection(FcgiEventLoop &loop, FcgiManager &manager,
+                   size_t capacity = FcgiResponseReader::kDefaultCapacity)
+      : loop_(loop), manager_(manager), reader_(manager, capacity) {
+    manager_.set_nonblocking(true);
+  }
+
+  FcgiManager &manager() { return manager_; }
+  FcgiResponseReader &reader() { return reader_; }
+
+  // Starts the clock on deadlines for the calls that follow; call it again
+  // for every request on a kept-alive connection. A phase that runs out
+  // fails the call with ETIMEDOUT. In nextRecord() that instead sends
+  // ABORT_REQUEST and hands out only END_REQUEST from then on, so that the
+  // connection survives if it arrives within abort_grace; timed_out()
+  // tells such a request apart. After any other timeout the connection
+  // must be closed.
+  void set_deadlines(const FcgiDeadlines &deadlines) {
+    deadlines_ = deadlines;
+    timed_ = true;
+    started_ = FcgiTimerWheel::now_ms();
+    phase_ = kNoPhase;
+    aborted_ = timed_out_ = false;
+  }
+
+  // True once a deadline passed, even if END_REQUEST still came in time.
+  bool timed_out() const { return timed_out_; }
+
+  // Returns 0 once connected, -1 on errors.
+  FcgiTask<int> connect(const char *addr, int port) {
+    enter(kConnectPhase);
+    int res = manager_.start(addr, port);
+    if (res == 0) co_return 0;
+    if (!manager_.connecting()) co_return -1;
+    res = co_await wait(EPOLLOUT);
+    co_return res < 0 ? -1 : manager_.finishConnect();
+  }
+
+  FcgiTask<int> startParams(FcgiRole role, bool keep_alive, int request_id) {
+    FcgiRequestBegin msg{{kTypeBegin, sizeof(FcgiRequestBeginBody), request_id},
+                         {role, keep_alive}};
+    enter(kSendPhase);
+    aborted_ = false;
+    manager_.traceBegin(request_id);
+    manager_.traceSent(kTypeBegin, 1, sizeof(msg));
+    iovec iov = {&msg, sizeof(msg)};
+    co_return co_await writeAll(&iov, 1);
+  }
+
+  // Sends the whole params stream, terminator included.
+  FcgiTask<int> sendParams(FcgiParamsBuilder &builder) {
+    builder.finish();
+    std::vector<iovec> iov;
+    iov.reserve(builder.segments());
+    builder.forEachSegment([&](const Byte *data, size_t length) {
+      iov.push_back({const_cast<Byte *>(data), length});
+    });
+    manager_.traceSent(kTypeParams, builder.records(), builder.size());
+    int res = co_await writeAll(iov.data(), static_cast<int>(iov.size()));
+    manager_.traceParamsFlushed();
+    co_return res;
+  }
+
+  // Sends the body as STDIN records followed by the terminating one.
+  // Returns the number of body bytes sent or -1.
+  FcgiTask<ssize_t> sendStdin(int request_id, const void *data,
+                              size_t length) {
+    FcgiStdinStream stream(manager_, request_id);
+    auto src = static_cast<const Byte *>(data);
+    size_t sent = 0;
+    enter(kSendPhase);
+
+    while (sent < length) {
+      auto accepted = stream.write(src + sent, length - sent);
+      if (accepted < 0) co_return -1;
+      sent += accepted;
+      if (!stream.blocked()) continue;
+      int ready = co_await wait(EPOLLOUT);
+      if (ready < 0) co_return -1;
+    }
+
+    int ended;
+    while ((ended = stream.end()) == 0) {
+      int ready = co_await wait(EPOLLOUT);
+      if (ready < 0) co_return -1;
+    }
+    co_return ended < 0 ? -1 : static_cast<ssize_t>(sent);
+  }
+
+  // Waits for the next record of request_id, skipping the others. Returns
+  // 1 on a record, 0 once the peer closed the connection and -1 on errors.
+  // The record points into the reader and is valid until the next call.
+  FcgiTask<int> nextRecord(int request_id, FcgiRecord *record) {
+    enter(kFirstBytePhase);
+    for (;;) {
+      int parsed;
+      while ((parsed = reader_.parse(record)) == 1) {
+        if (record->request_id != request_id) continue;
+        if (!aborted_ || record->type == kTypeEnd) co_return 1;
+      }
+      if (parsed < 0) co_return -1;
+
+      auto received = reader_.fill();
+      if (received == 0) co_return 0;
+      if (received > 0) {
+        enter(kBodyPhase);
+        continue;
+      }
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) co_return -1;
+
+      // An ABORT_REQUEST the socket did not take yet goes out as room
+      // frees up.
+      bool flushing = manager_.pending() > 0;
+      int ready = co_await wait(flushing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+      if (ready == 0) {
+        if (flushing && manager_.flush() < 0 && errno != EAGAIN &&
+            errno != EWOULDBLOCK)
+          co_return -1;
+        continue;
+      }
+      if (errno != ETIMEDOUT || aborted_) co_return -1;
+
+      aborted_ = timed_out_ = true;
+      enter(kAbortPhase);
+      if (manager_.abortRequest(request_id) < 0) co_return -1;
+    }
+  }
+
+ private:
+  // In the order a request goes through them.
+  enum Phase {
+    kNoPhase,
+    kConnectPhase,
+    kSendPhase,
+    kFirstBytePhase,
+    kBodyPhase,
+    kAbortPhase
+  };
+
+  // Starts the clock on phase unless the request is already past it.
+  void enter(Phase phase) {
+    if (!timed_ || phase <= phase_) return;
+    phase_ = phase;
+    phase_started_ = FcgiTimerWheel::now_ms();
+  }
+
+  // Milliseconds left for the current phase, cut short by what is left of
+  // the total budget; 0 when unbounded.
+  uint64_t budget() const {
+    if (!timed_ || phase_ == kNoPhase) return 0;
+    uint64_t limit = 0;
+    switch (phase_) {
+      case kConnectPhase:
+        limit = deadlines_.connect;
+        break;
+      case kSendPhase:
+        limit = deadlines_.send;
+        break;
+      case kFirstBytePhase:
+        limit = deadlines_.first_byte;
+        break;
+      case kAbortPhase:
+        limit = deadlines_.abort_grace;
+        break;
+      default:
+        break;
+    }
+
+    uint64_t end = limit > 0 ? phase_started_ + limit : 0;
+    if (deadlines_.total > 0 && phase_ != kAbortPhase) {
+      auto total_end = started_ + deadlines_.total;
+      if (end == 0 || total_end < end) end = total_end;
+    }
+    if (end == 0) return 0;
+    auto now = FcgiTimerWheel::now_ms();
+    return end > now ? end - now : 1;
+  }
+
+  FcgiEventLoop::Readiness wait(uint32_t events) {
+    return FcgiEventLoop::Readiness(loop_, manager_.fd(), events, budget());
+  }
+
+  // Writes everything iov describes, waiting for room as needed.
+  FcgiTask<int> writeAll(iovec *iov, int iovcnt) {
+    for (;;) {
+      while (iovcnt > 0 && iov->iov_len == 0) ++iov, --iovcnt;
+      if (iovcnt == 0) co_return 0;
+
+      if (manager_.doWritev(iov, iovcnt) < 0 && errno != EAGAIN &&
+          errno != EWOULDBLOCK)
+        co_return -1;
+      while (iovcnt > 0 && iov->iov_len == 0) ++iov, --iovcnt;
+      if (iovcnt == 0) co_return 0;
+      int ready = co_await wait(EPOLLOUT);
+      if (ready < 0) co_return -1;
+    }
+  }
+
+  FcgiEventLoop &loop_;
+  FcgiManager &manager_;
+  FcgiResponseReader reader_;
+  FcgiDeadlines deadlines_;
+  bool timed_ = false;
+  bool aborted_ = false;
+  bool timed_out_ = false;
+  Phase phase_ = kNoPhase;
+  uint64_t started_ = 0;
+  uint64_t phase_started_ = 0;
 };
+#endif  // PFASTCGI_HAS_COROUTINES
 
 }  // namespace pfcgi
 
@@ -0,0 +1,492 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018 hepangda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+// Regression tests for pfastcgi.hpp. Build and run with
+//
+//   g++ -O2 -std=c++11 -I. test/pfastcgi_test.cpp -o pfastcgi_test -pthread
+//   ./pfastcgi_test
+//
+// or through CMake and ctest. Clients talk to FcgiServerConnection over a
+// socketpair and to FcgiServer over a Unix socket in the temp directory.
+
+#include "pfastcgi.hpp"
+
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace pfcgi;
+
+int failures = 0;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      ++failures;                                                      \
+    }                                                                  \
+  } while (0)
+
+// A client on one end of a socketpair; it owns and closes the fd.
+struct Manager : FcgiManager {
+  explicit Manager(int fd, bool nonblocking = false) {
+    set_fcgifd(fd);
+    set_nonblocking(nonblocking);
+  }
+  int start(const char *, int) override { return 0; }
+};
+
+std::string tempPath(const char *name) {
+  const char *dir = getenv("TMPDIR");
+  return std::string(dir != nullptr ? dir : "/tmp") + "/pfastcgi_test." +
+         std::to_string(getpid()) + "." + name;
+}
+
+std::string record(FcgiType type, int request_id, const std::string &content,
+                   int padding = 0) {
+  FcgiHeader header(type, static_cast<int>(content.size()), request_id,
+                    padding);
+  std::string out(reinterpret_cast<const char *>(&header), sizeof(header));
+  return out + content + std::string(padding, '\0');
+}
+
+// Answers with the length of STDIN and the SCRIPT_FILENAME it was given.
+struct EchoHandler : FcgiRequestHandler {
+  int onRequest(FcgiServerRequest &request,
+                FcgiServerConnection &connection) override {
+    size_t length = 0;
+    auto script = request.find("SCRIPT_FILENAME", &length);
+    std::string out = "Status: 201 Created\r\nContent-Length: 0\r\n\r\n" +
+                      std::string(script != nullptr ? script : "-", length) +
+                      ":" + std::to_string(request.stdin_length());
+    connection.sendStdout(request.request_id(), out.data(), out.size());
+    return 7;
+  }
+};
+
+// Sends one responder request and collects its STDOUT; returns the app
+// status, or -1 if END_REQUEST did not come.
+int roundTrip(FcgiManager &manager, int request_id, size_t stdin_length,
+              std::string *out, int *protocol_status = nullptr) {
+  FcgiParamsBuilder params(request_id);
+  params.add("SCRIPT_FILENAME", "/srv/index.php");
+  manager.startParams(kRoleResponder, true, request_id);
+  manager.sendParams(params);
+  std::string body(stdin_length, 'i');
+  manager.sendStdin(request_id, body.data(), body.size());
+  manager.endStdin(request_id);
+
+  FcgiResponseReader reader(manager);
+  FcgiRecord record;
+  while (reader.next(request_id, &record) == 1) {
+    if (record.type == kTypeStdout)
+      out->append(reinterpret_cast<const char *>(record.content),
+                  record.content_length);
+    if (record.type == kTypeEnd) {
+      if (protocol_status != nullptr)
+        *protocol_status = record.protocol_status();
+      return record.app_status();
+    }
+  }
+  return -1;
+}
+
+void testNameValues() {
+  std::string value(300, 'v');
+  Byte buf[64 + 300];
+  auto length = FcgiParams::encode(buf, 4, value.size());
+  CHECK(length == 5);  // 1-byte name length, 4-byte value length
+  memcpy(buf + length, "NAME", 4);
+  memcpy(buf + length + 4, value.data(), value.size());
+  length += 4 + value.size();
+  length += FcgiParams::encode(buf + length, 1, 0);
+  buf[length++] = 'E';
+
+  FcgiNameValueParser parser(buf, length);
+  const Byte *name, *data;
+  size_t name_length, value_length;
+  CHECK(parser.next(&name, &name_length, &data, &value_length) == 1);
+  CHECK(name_length == 4 && memcmp(name, "NAME", 4) == 0);
+  CHECK(value_length == 300 && memcmp(data, value.data(), 300) == 0);
+  CHECK(parser.next(&name, &name_length, &data, &value_length) == 1);
+  CHECK(name_length == 1 && name[0] == 'E' && value_length == 0);
+  CHECK(parser.next(&name, &name_length, &data, &value_length) == 0);
+
+  FcgiNameValueParser truncated(buf, length - 100);
+  CHECK(truncated.next(&name, &name_length, &data, &value_length) == -1);
+}
+
+void testScanRecords() {
+  auto stream = record(kTypeStdout, 1, "hello", 3) + record(kTypeEnd, 2, "") +
+                record(kTypeStderr, 3, "partial");
+  auto bytes = reinterpret_cast<const Byte *>(stream.data());
+  FcgiRecordDesc out[4];
+  size_t consumed;
+  bool corrupt = true;
+
+  CHECK(fcgiScanRecords(bytes, stream.size() - 1, out, 4, &consumed,
+                        &corrupt) == 2);
+  CHECK(consumed == 16 + 8 && !corrupt);
+  CHECK(out[0].offset == 8 && out[0].length == 5 && out[0].request_id == 1);
+  CHECK(out[0].type == kTypeStdout);
+  CHECK(out[1].offset == 24 && out[1].length == 0 && out[1].type == kTypeEnd);
+
+  stream[consumed] = 2;  // version of the third header
+  CHECK(fcgiScanRecords(bytes, stream.size(), out, 4, &consumed,
+                        &corrupt) == 2);
+  CHECK(consumed == 24 && corrupt);
+}
+
+ssize_t feedHeaders(FcgiResponseHeaders &headers, const char *text) {
+  return headers.feed(reinterpret_cast<const Byte *>(text), strlen(text));
+}
+
+void testResponseHeaders() {
+  const char *text = "Status: 404 Not Found\r\nContent-Length: 12\r\n\r\nbody";
+  FcgiResponseHeaders headers;
+  CHECK(feedHeaders(headers, text) ==
+        static_cast<ssize_t>(strlen(text) - 4));
+  CHECK(headers.done() && headers.status() == 404);
+  CHECK(headers.content_length() == 12);
+
+  FcgiResponseHeaders redirect;
+  CHECK(feedHeaders(redirect, "Location: /next\n\n") > 0);
+  CHECK(redirect.status() == 302);
+
+  const char *bad[] = {"Content-Length: 99999999999999999999\n\n",
+                       "Content-Length: 12abc\n\n", "Content-Length:\n\n",
+                       "no colon\n\n"};
+  for (auto line : bad) {
+    FcgiResponseHeaders rejected;
+    errno = 0;
+    CHECK(feedHeaders(rejected, line) == -1 && errno == EPROTO);
+  }
+}
+
+void testUpstreamLimits() {
+  auto body = [](const std::string &value) {
+    std::string out;
+    out += static_cast<char>(14);
+    out += static_cast<char>(value.size());
+    return out + "FCGI_MAX_CONNS" + value;
+  };
+  FcgiUpstreamLimits limits;
+  auto clamped = body("99999999999");
+  CHECK(limits.parse(reinterpret_cast<const Byte *>(clamped.data()),
+                     clamped.size()));
+  CHECK(limits.max_conns == INT_MAX);
+
+  FcgiUpstreamLimits empty;
+  auto none = body("");
+  CHECK(empty.parse(reinterpret_cast<const Byte *>(none.data()),
+                    none.size()));
+  CHECK(empty.max_conns == 0);
+}
+
+void testTimerWheel() {
+  struct Fired {
+    std::vector<int> order;
+    FcgiTimerWheel *wheel;
+    uint64_t at[5];
+  } fired;
+  FcgiTimerWheel wheel(1000);
+  fired.wheel = &wheel;
+
+  // Delays across the wheel's levels, scheduled out of order.
+  const uint64_t delays[] = {70000, 3, 300000, 300, 3};
+  struct Entry {
+    FcgiTimer timer;
+    Fired *fired;
+    int index;
+  } entries[5];
+  for (int i = 0; i < 5; ++i) {
+    entries[i].fired = &fired;
+    entries[i].index = i;
+    entries[i].timer.set_callback(
+        [](FcgiTimer &, void *context) {
+          auto entry = static_cast<Entry *>(context);
+          entry->fired->order.push_back(entry->index);
+          entry->fired->at[entry->index] = entry->fired->wheel->now();
+        },
+        &entries[i]);
+    wheel.schedule(entries[i].timer, delays[i]);
+  }
+  entries[4].timer.cancel();
+
+  uint64_t now = 1000;
+  for (int steps = 0; steps < 100000; ++steps) {
+    int timeout = wheel.timeout(now);
+    if (timeout < 0) break;
+    now += timeout > 0 ? timeout : 1;
+    wheel.advance(now);
+  }
+
+  CHECK(fired.order.size() == 4);
+  if (fired.order.size() == 4) {
+    const int expected[] = {1, 3, 0, 2};
+    for (int i = 0; i < 4; ++i) {
+      int index = fired.order[i];
+      CHECK(index == expected[i]);
+      CHECK(fired.at[index] == 1000 + delays[index]);
+    }
+  }
+}
+
+void testArenaAlignment() {
+  FcgiRequestArena arena;
+  int misaligned = 0;
+  for (size_t i = 0; i < 5000; ++i) {
+    auto ptr = reinterpret_cast<uintptr_t>(arena.allocate(1 + i % 3000));
+    if (ptr % alignof(std::max_align_t) != 0) ++misaligned;
+  }
+  CHECK(misaligned == 0);
+}
+
+void testServerConnection() {
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  FcgiUpstreamLimits limits;
+  limits.max_conns = 10;
+  limits.max_reqs = 20;
+  int served = -2;
+  std::thread server([&] {
+    EchoHandler handler;
+    FcgiServerConnection connection(sv[1], limits);
+    served = connection.serve(handler);
+  });
+
+  Manager manager(sv[0]);
+  FcgiUpstreamLimits got;
+  CHECK(manager.getValues(&got) == 0);
+  CHECK(got.max_conns == 10 && got.max_reqs == 20 && !got.mpxs_conns);
+
+  std::string out;
+  CHECK(roundTrip(manager, 1, 100000, &out) == 7);
+  CHECK(out.find("\r\n\r\n/srv/index.php:100000") != std::string::npos);
+
+  // Request 2 stays open, so 3 is refused on a connection without
+  // FCGI_MPXS_CONNS; aborting 2 then ends it.
+  manager.startParams(kRoleResponder, true, 2);
+  int protocol_status = -1;
+  out.clear();
+  CHECK(roundTrip(manager, 3, 0, &out, &protocol_status) == 0);
+  CHECK(protocol_status == kCantMpxConn && out.empty());
+
+  CHECK(manager.abortRequest(2) >= 0);
+  FcgiResponseReader reader(manager);
+  FcgiRecord end;
+  while (reader.next(2, &end) == 1 && end.type != kTypeEnd) {
+  }
+  CHECK(end.type == kTypeEnd && end.protocol_status() == kRequestComplete);
+
+  shutdown(sv[0], SHUT_WR);
+  server.join();
+  CHECK(served == 0);
+}
+
+void testStdinFromFile() {
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  Manager manager(sv[0]);
+
+  auto path = tempPath("stdin");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  CHECK(fd >= 0);
+  unlink(path.c_str());
+  std::string content(1000, 'f');
+  CHECK(write(fd, content.data(), content.size()) == 1000);
+  lseek(fd, 0, SEEK_SET);
+
+  // The file is shorter than asked for; its records must cover only what
+  // it holds.
+  FcgiStdinStream stream(manager, 1);
+  CHECK(stream.writeFrom(fd, 4096) == 1000);
+  CHECK(stream.writeFrom(fd, 4096) == 0);
+  CHECK(stream.end() >= 0);
+  close(fd);
+  shutdown(sv[0], SHUT_WR);
+
+  std::string received;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(sv[1], buf, sizeof(buf))) > 0) received.append(buf, n);
+  close(sv[1]);
+
+  size_t pos = 0, body = 0;
+  bool ended = false;
+  while (pos + sizeof(FcgiHeader) <= received.size()) {
+    FcgiHeader header;
+    memcpy(&header, received.data() + pos, sizeof(header));
+    CHECK(header.type == kTypeStdin);
+    if (header.content_length() == 0) ended = true;
+    body += header.content_length();
+    pos += sizeof(header) + header.content_length() + header.padding_length;
+  }
+  CHECK(pos == received.size() && body == 1000 && ended);
+}
+
+void testSigpipe() {
+  // Writing to a closed peer must fail with EPIPE instead of killing us.
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  close(sv[1]);
+  Manager manager(sv[0]);
+  std::string big(1 << 20, 'x');
+  errno = 0;
+  CHECK(manager.sendStdin(1, big.data(), big.size()) < 0 && errno == EPIPE);
+}
+
+void testPoolLimits() {
+  // A failed connect gives its slot back and reports the connect error.
+  FcgiConnectionPool missing(FcgiEndpoint(tempPath("missing")), 1, 1);
+  for (int i = 0; i < 3; ++i) {
+    errno = 0;
+    CHECK(missing.acquire() == nullptr && errno == ENOENT);
+  }
+
+  auto path = tempPath("pool");
+  EchoHandler handler;
+  FcgiServer server(handler);
+  CHECK(server.listen(FcgiEndpoint(path)) == 0);
+  FcgiConnectionPool pool(FcgiEndpoint(path), 1, 1);
+  auto first = pool.acquire();
+  CHECK(first != nullptr);
+  errno = 0;
+  CHECK(pool.acquire() == nullptr && errno == EBUSY);
+  pool.release(std::move(first), false);
+  CHECK(pool.acquire() != nullptr);
+}
+
+void testLongUnixPath() {
+  std::string path(sizeof(sockaddr_un::sun_path), 'p');
+  errno = 0;
+  CHECK(FcgiEndpoint(path).connect() == nullptr && errno == ENAMETOOLONG);
+
+  EchoHandler handler;
+  FcgiServer server(handler);
+  errno = 0;
+  CHECK(server.listen(FcgiEndpoint(path)) < 0 && errno == ENAMETOOLONG);
+}
+
+void testAsyncStdinPadding() {
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  Manager manager(sv[0], true);
+  std::string body(kFcgiMaxContentLength + 13, 'b');
+  FcgiAsyncRequest request(manager, 1);
+  request.params().add("SCRIPT_FILENAME", "/srv/index.php");
+  request.setStdin(body.data(), body.size());
+
+  const Byte *data;
+  size_t length;
+  CHECK(request.output(&data, &length));
+  size_t pos = 0, stdin_records = 0;
+  while (pos + sizeof(FcgiHeader) <= length) {
+    FcgiHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    size_t total = header.content_length() + header.padding_length;
+    if (header.type == kTypeStdin) {
+      CHECK(total % 8 == 0);
+      ++stdin_records;
+    }
+    pos += sizeof(header) + total;
+  }
+  CHECK(pos == length && stdin_records == 3);
+  close(sv[1]);
+}
+
+void testAsyncLoop() {
+  auto path = tempPath("async");
+  EchoHandler handler;
+  FcgiServer server(handler);
+  CHECK(server.listen(FcgiEndpoint(path)) == 0);
+  std::thread worker([&] { server.run(1); });
+
+  FcgiAsyncLoop loop;
+  CHECK(loop.ok());
+  const int kRequests = 8;
+  std::vector<std::unique_ptr<FcgiManager>> managers;
+  std::vector<std::unique_ptr<FcgiAsyncRequest>> requests;
+  std::string body(70000, 'b');
+  for (int i = 0; i < kRequests; ++i) {
+    managers.push_back(FcgiEndpoint(path).connect(true));
+    CHECK(managers.back() != nullptr);
+    if (managers.back() == nullptr) break;
+    requests.emplace_back(new FcgiAsyncRequest(*managers.back(), 1));
+    requests.back()->params().add("SCRIPT_FILENAME", "/srv/index.php");
+    requests.back()->setStdin(body.data(), i % 2 == 0 ? body.size() : 5);
+    CHECK(loop.add(*requests.back()) == 0);
+  }
+
+  int done = 0, ends = 0;
+  std::string out;
+  CHECK(loop.run([&](FcgiAsyncRequest &request, const FcgiRecord *record) {
+    if (record == nullptr) {
+      if (request.state() == FcgiAsyncRequest::kDone) ++done;
+    } else if (record->type == kTypeStdout) {
+      out.append(reinterpret_cast<const char *>(record->content),
+                 record->content_length);
+    } else if (record->type == kTypeEnd && record->app_status() == 7) {
+      ++ends;
+    }
+  }) == 0);
+  CHECK(done == kRequests && ends == kRequests);
+  CHECK(out.find(":70000") != std::string::npos);
+  CHECK(out.find(":5") != std::string::npos);
+
+  server.stop();
+  worker.join();
+}
+
+}  // namespace
+
+int main() {
+  testNameValues();
+  testScanRecords();
+  testResponseHeaders();
+  testUpstreamLimits();
+  testTimerWheel();
+  testArenaAlignment();
+  testServerConnection();
+  testStdinFromFile();
+  testSigpipe();
+  testPoolLimits();
+  testLongUnixPath();
+  testAsyncStdinPadding();
+  testAsyncLoop();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  puts("all tests passed");
+  return 0;
+}